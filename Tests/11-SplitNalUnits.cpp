@@ -0,0 +1,462 @@
+#define _CRT_SECURE_NO_WARNINGS 1
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <vector>
+#include <iostream>
+#include "fmt/format.h"
+#include "CapturedStreamParser.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+	#define HAS_SSE2 1
+	#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+	#define HAS_AVX2 1
+	#include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+	#include <intrin.h>
+#endif
+
+
+
+
+
+/** The video codec of the NAL units. */
+enum class Codec
+{
+	H264,
+	H265,
+};
+
+
+
+
+
+/** A single NAL unit, as a view into the frame data (without the start code). */
+struct NalUnit
+{
+	/** The NAL unit data, starting with the NAL header. */
+	const uint8_t * mData;
+
+	/** The size of the NAL unit data. */
+	size_t mSize;
+
+	/** The codec of the NAL unit. */
+	Codec mCodec;
+
+	/** The nal_unit_type from the NAL header. */
+	int mType;
+};
+
+
+
+
+
+/** A function that returns the position of the first 00 00 01 start code at or after aStart,
+or aSize if there's no more start codes. */
+using FindStartCodeFn = size_t (*)(const uint8_t * aData, size_t aSize, size_t aStart);
+
+
+
+
+
+/** Finds the start code by checking each position in turn, as the reference. */
+static size_t findStartCodeNaive(const uint8_t * aData, size_t aSize, size_t aStart)
+{
+	for (size_t i = aStart; i + 2 < aSize; ++i)
+	{
+		if ((aData[i] == 0) && (aData[i + 1] == 0) && (aData[i + 2] == 1))
+		{
+			return i;
+		}
+	}
+	return aSize;
+}
+
+
+
+
+
+/** Finds the start code by looking at every third byte; any byte larger than 1 there means that no
+start code can overlap it, so the scan can skip ahead by 3 bytes. */
+static size_t findStartCodeScalar(const uint8_t * aData, size_t aSize, size_t aStart)
+{
+	size_t i = aStart;
+	while (i + 2 < aSize)
+	{
+		auto b = aData[i + 2];
+		if (b > 1)
+		{
+			i += 3;
+		}
+		else if ((b == 1) && (aData[i] == 0) && (aData[i + 1] == 0))
+		{
+			return i;
+		}
+		else
+		{
+			i += 1;
+		}
+	}
+	return aSize;
+}
+
+
+
+
+
+/** Returns the index of the lowest set bit in the (non-zero) mask. */
+static inline unsigned lowestBit(uint32_t aMask)
+{
+	#if defined(_MSC_VER)
+		unsigned long idx;
+		_BitScanForward(&idx, aMask);
+		return static_cast<unsigned>(idx);
+	#else
+		return static_cast<unsigned>(__builtin_ctz(aMask));
+	#endif
+}
+
+
+
+
+
+#ifdef HAS_SSE2
+/** Finds the start code 16 positions at a time, comparing three overlapping loads against 00, 00 and 01. */
+static size_t findStartCodeSse2(const uint8_t * aData, size_t aSize, size_t aStart)
+{
+	const auto zero = _mm_setzero_si128();
+	const auto one = _mm_set1_epi8(1);
+	size_t i = aStart;
+	for (; i + 2 + 16 <= aSize; i += 16)
+	{
+		auto b0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(aData + i));
+		auto b1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(aData + i + 1));
+		auto b2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(aData + i + 2));
+		auto match = _mm_and_si128(
+			_mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)),
+			_mm_cmpeq_epi8(b2, one)
+		);
+		auto mask = static_cast<uint32_t>(_mm_movemask_epi8(match));
+		if (mask != 0)
+		{
+			return i + lowestBit(mask);
+		}
+	}
+	return findStartCodeScalar(aData, aSize, i);
+}
+#endif
+
+
+
+
+
+#ifdef HAS_AVX2
+/** Finds the start code 32 positions at a time, same as findStartCodeSse2(). */
+static size_t findStartCodeAvx2(const uint8_t * aData, size_t aSize, size_t aStart)
+{
+	const auto zero = _mm256_setzero_si256();
+	const auto one = _mm256_set1_epi8(1);
+	size_t i = aStart;
+	for (; i + 2 + 32 <= aSize; i += 32)
+	{
+		auto b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(aData + i));
+		auto b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(aData + i + 1));
+		auto b2 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(aData + i + 2));
+		auto match = _mm256_and_si256(
+			_mm256_and_si256(_mm256_cmpeq_epi8(b0, zero), _mm256_cmpeq_epi8(b1, zero)),
+			_mm256_cmpeq_epi8(b2, one)
+		);
+		auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(match));
+		if (mask != 0)
+		{
+			return i + lowestBit(mask);
+		}
+	}
+	return findStartCodeScalar(aData, aSize, i);
+}
+#endif
+
+
+
+
+
+/** Returns the fastest start code finder available in this build. */
+static FindStartCodeFn bestFindStartCode()
+{
+	#if defined(HAS_AVX2)
+		return &findStartCodeAvx2;
+	#elif defined(HAS_SSE2)
+		return &findStartCodeSse2;
+	#else
+		return &findStartCodeScalar;
+	#endif
+}
+
+
+
+
+
+/** Splits the Annex-B frame data into NAL units, calling aCallback for each one.
+The NAL units are views into aData, no data is copied. The trailing zero bytes before the next start
+code (the leading zero of a 4-byte start code) are not included in the NAL unit. */
+static void splitNalUnits(
+	const uint8_t * aData,
+	size_t aSize,
+	Codec aCodec,
+	FindStartCodeFn aFindStartCode,
+	const std::function<void(const NalUnit &)> & aCallback
+)
+{
+	auto pos = aFindStartCode(aData, aSize, 0);
+	while (pos < aSize)
+	{
+		auto start = pos + 3;
+		auto next = aFindStartCode(aData, aSize, start);
+		auto end = next;
+		while ((end > start) && (aData[end - 1] == 0))
+		{
+			end -= 1;
+		}
+		if (end > start)
+		{
+			int type = (aCodec == Codec::H264) ? (aData[start] & 0x1f) : ((aData[start] >> 1) & 0x3f);
+			aCallback({aData + start, end - start, aCodec, type});
+		}
+		pos = next;
+	}
+}
+
+
+
+
+
+/** Keeps a copy of the latest parameter set NAL units (VPS, SPS, PPS) of a single stream. */
+class ParameterSetCache
+{
+public:
+
+	/** Stores the NAL unit, if it is a parameter set. Returns true if it was a parameter set. */
+	bool update(const NalUnit & aNalUnit)
+	{
+		std::vector<uint8_t> * dest = nullptr;
+		if (aNalUnit.mCodec == Codec::H264)
+		{
+			switch (aNalUnit.mType)
+			{
+				case 7: dest = &mSps; break;
+				case 8: dest = &mPps; break;
+			}
+		}
+		else
+		{
+			switch (aNalUnit.mType)
+			{
+				case 32: dest = &mVps; break;
+				case 33: dest = &mSps; break;
+				case 34: dest = &mPps; break;
+			}
+		}
+		if (dest == nullptr)
+		{
+			return false;
+		}
+		dest->assign(aNalUnit.mData, aNalUnit.mData + aNalUnit.mSize);
+		return true;
+	}
+
+	/** The latest VPS (H.265 only). */
+	std::vector<uint8_t> mVps;
+
+	/** The latest SPS. */
+	std::vector<uint8_t> mSps;
+
+	/** The latest PPS. */
+	std::vector<uint8_t> mPps;
+};
+
+
+
+
+
+/** Detects the codec from the first NAL unit of an I-frame: H.265 I-frames start with a VPS (40 01),
+H.264 ones with an SPS. */
+static Codec detectCodec(const std::vector<uint8_t> & aIFrame)
+{
+	auto pos = findStartCodeNaive(aIFrame.data(), aIFrame.size(), 0);
+	if ((pos + 4 < aIFrame.size()) && (aIFrame[pos + 3] == 0x40) && (aIFrame[pos + 4] == 0x01))
+	{
+		return Codec::H265;
+	}
+	return Codec::H264;
+}
+
+
+
+
+
+/** Splits all the frames using the specified start code finder, returns the offsets of all the NAL
+units (relative to their frame) and the time it took to split all frames aNumRounds times. */
+static std::vector<size_t> splitAll(
+	const std::vector<std::vector<uint8_t>> & aFrames,
+	Codec aCodec,
+	FindStartCodeFn aFindStartCode,
+	int aNumRounds,
+	std::chrono::steady_clock::duration & aElapsed
+)
+{
+	std::vector<size_t> offsets;
+	auto startTime = std::chrono::steady_clock::now();
+	for (int round = 0; round < aNumRounds; ++round)
+	{
+		offsets.clear();
+		for (const auto & frame: aFrames)
+		{
+			splitNalUnits(frame.data(), frame.size(), aCodec, aFindStartCode,
+				[&offsets, &frame](const NalUnit & aNalUnit)
+				{
+					offsets.push_back(static_cast<size_t>(aNalUnit.mData - frame.data()));
+				}
+			);
+		}
+	}
+	aElapsed = std::chrono::steady_clock::now() - startTime;
+	return offsets;
+}
+
+
+
+
+
+/** This test program parses a raw CapturedStream (from R15 real device test) and splits the video frames
+into NAL units. It checks that the optimized start code finders (scalar, SSE2, AVX2, depending on the
+build) find the same NAL units as the naive byte-by-byte scan, reports the NAL unit types and cached
+parameter sets, and benchmarks the finders against each other.
+The input file can be specified as the first param; defaults to "R15-out.raw" (as per R15's output).
+The number of benchmark rounds can be specified as the second param; defaults to 20. */
+int main(int argc, const char ** argv)
+{
+	const char * fileName = (argc > 1) ? argv[1] : "R15-out.raw";
+	int numRounds = (argc > 2) ? std::atoi(argv[2]) : 20;
+	auto fIn = fopen(fileName, "rb");
+	if (fIn == nullptr)
+	{
+		std::cerr << "Failed to open input file " << fileName << std::endl;
+		return 1;
+	}
+
+	// Parse the whole file into frames kept in memory:
+	std::vector<std::vector<uint8_t>> frames;
+	std::vector<uint8_t> firstIFrame;
+	size_t totalSize = 0;
+	auto onFrame = [&frames, &totalSize](const void * aData, size_t aSize)
+	{
+		auto data = static_cast<const uint8_t *>(aData);
+		frames.emplace_back(data, data + aSize);
+		totalSize += aSize;
+	};
+	NetSurveillancePp::CapturedStreamParser parser(
+		[&](const void * aData, size_t aSize)
+		{
+			onFrame(aData, aSize);
+			if (firstIFrame.empty())
+			{
+				firstIFrame = frames.back();
+			}
+		},
+		onFrame
+	);
+	while (true)
+	{
+		char buf[512];
+		auto numBytesRead = fread(buf, 1, sizeof(buf), fIn);
+		if (numBytesRead == 0)
+		{
+			break;
+		}
+		try
+		{
+			parser.parse(buf, numBytesRead);
+		}
+		catch (const std::exception & exc)
+		{
+			std::cerr << "Exception while parsing: " << exc.what() << std::endl;
+			return 2;
+		}
+	}
+	fclose(fIn);
+	if (firstIFrame.empty())
+	{
+		std::cerr << "No I-frame found in the input." << std::endl;
+		return 3;
+	}
+	auto codec = detectCodec(firstIFrame);
+	std::cout << fmt::format("Parsed {} frames, {} bytes, codec {}\n", frames.size(), totalSize, (codec == Codec::H264) ? "H.264" : "H.265");
+
+	// Report the NAL unit types and the parameter sets:
+	ParameterSetCache paramSets;
+	std::vector<size_t> typeCounts(64);
+	for (const auto & frame: frames)
+	{
+		splitNalUnits(frame.data(), frame.size(), codec, bestFindStartCode(),
+			[&](const NalUnit & aNalUnit)
+			{
+				typeCounts[static_cast<size_t>(aNalUnit.mType)] += 1;
+				paramSets.update(aNalUnit);
+			}
+		);
+	}
+	for (size_t type = 0; type < typeCounts.size(); ++type)
+	{
+		if (typeCounts[type] > 0)
+		{
+			std::cout << fmt::format("  NAL type {}: {} units\n", type, typeCounts[type]);
+		}
+	}
+	std::cout << fmt::format("Cached parameter sets: VPS {} bytes, SPS {} bytes, PPS {} bytes\n", paramSets.mVps.size(), paramSets.mSps.size(), paramSets.mPps.size());
+	if (paramSets.mSps.empty() || paramSets.mPps.empty())
+	{
+		std::cerr << "The SPS or PPS was not found in the stream." << std::endl;
+		return 4;
+	}
+
+	// Check and benchmark the finders:
+	struct Finder
+	{
+		const char * mName;
+		FindStartCodeFn mFn;
+	};
+	std::vector<Finder> finders =
+	{
+		{"naive", &findStartCodeNaive},
+		{"scalar", &findStartCodeScalar},
+		#ifdef HAS_SSE2
+			{"SSE2", &findStartCodeSse2},
+		#endif
+		#ifdef HAS_AVX2
+			{"AVX2", &findStartCodeAvx2},
+		#endif
+	};
+	std::vector<size_t> reference;
+	for (const auto & finder: finders)
+	{
+		std::chrono::steady_clock::duration elapsed;
+		auto offsets = splitAll(frames, codec, finder.mFn, numRounds, elapsed);
+		auto sec = std::chrono::duration<double>(elapsed).count();
+		auto mibPerSec = (sec > 0) ? (static_cast<double>(totalSize) * numRounds / sec / 1024 / 1024) : 0;
+		std::cout << fmt::format("{:>8}: {} NAL units, {:.3f} s for {} rounds, {:.1f} MiB/s\n", finder.mName, offsets.size(), sec, numRounds, mibPerSec);
+		if (reference.empty())
+		{
+			reference = std::move(offsets);
+		}
+		else if (offsets != reference)
+		{
+			std::cerr << "The " << finder.mName << " finder doesn't match the naive scan." << std::endl;
+			return 5;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,483 @@
+#define _CRT_SECURE_NO_WARNINGS 1
+#define _FILE_OFFSET_BITS 64  // fseeko() / ftello() with 64-bit off_t on 32-bit POSIX systems
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <iostream>
+#include "fmt/format.h"
+#include "CapturedStreamParser.hpp"
+
+
+
+
+
+/** A single entry in the sidecar index, describing one I-frame in the raw CapturedStream file. */
+struct IndexEntry
+{
+	/** The offset of the I-frame's header in the raw file. */
+	uint64_t mOffset;
+
+	/** The size of the whole I-frame, including its header. */
+	uint32_t mSize;
+
+	/** The device timestamp of the I-frame, converted to UNIX time (the device's local time is taken as UTC). */
+	uint32_t mTimeStamp;
+
+	/** The number of video frames (I and P) preceding this I-frame in the raw file. */
+	uint32_t mFrameNumber;
+};
+
+
+
+
+
+/** The magic at the start of the sidecar index file, followed by the number of entries (4 bytes) and
+the entries themselves (20 bytes each: offset (8), size (4), timestamp (4), frame number (4));
+all numbers are little-endian. */
+static const char cIndexMagic[8] = {'N', 'S', 'P', 'I', 'D', 'X', '0', '1'};
+
+
+
+
+
+/** Reads a little-endian number of the specified size from the buffer. */
+static uint64_t readLE(const uint8_t * aData, size_t aSize)
+{
+	uint64_t res = 0;
+	for (size_t i = aSize; i > 0; --i)
+	{
+		res = (res << 8) | aData[i - 1];
+	}
+	return res;
+}
+
+
+
+
+
+/** Writes a little-endian number of the specified size into the buffer. */
+static void writeLE(uint8_t * aData, uint64_t aValue, size_t aSize)
+{
+	for (size_t i = 0; i < aSize; ++i)
+	{
+		aData[i] = static_cast<uint8_t>(aValue >> (8 * i));
+	}
+}
+
+
+
+
+
+/** Sets the file position, with 64-bit offsets even where long is only 32-bit (MSVC); hour-long dumps exceed 2 GiB.
+Returns true on success. */
+static bool seekFile(FILE * aFile, int64_t aOffset, int aOrigin)
+{
+	#if defined(_MSC_VER)
+		return (_fseeki64(aFile, aOffset, aOrigin) == 0);
+	#else
+		return (fseeko(aFile, static_cast<off_t>(aOffset), aOrigin) == 0);
+	#endif
+}
+
+
+
+
+
+/** Returns the size of the file, in bytes. Moves the file position to the end of the file.
+Throws a std::runtime_error if the size cannot be determined. */
+static uint64_t getFileSize(FILE * aFile)
+{
+	if (!seekFile(aFile, 0, SEEK_END))
+	{
+		throw std::runtime_error("Cannot seek to the end of the file");
+	}
+	#if defined(_MSC_VER)
+		auto size = _ftelli64(aFile);
+	#else
+		auto size = ftello(aFile);
+	#endif
+	if (size < 0)
+	{
+		throw std::runtime_error("Cannot determine the file size");
+	}
+	return static_cast<uint64_t>(size);
+}
+
+
+
+
+
+/** Converts the packed device timestamp from the I-frame header into UNIX time. */
+static uint32_t unpackDeviceTime(uint32_t aPacked)
+{
+	int year   = static_cast<int>((aPacked >> 26) & 0x3f) + 2000;
+	int month  = static_cast<int>((aPacked >> 22) & 0x0f);
+	int day    = static_cast<int>((aPacked >> 17) & 0x1f);
+	int hour   = static_cast<int>((aPacked >> 12) & 0x1f);
+	int minute = static_cast<int>((aPacked >> 6) & 0x3f);
+	int second = static_cast<int>(aPacked & 0x3f);
+
+	// Days since 1970-01-01 of the civil date (proleptic Gregorian calendar):
+	int y = (month <= 2) ? (year - 1) : year;
+	int era = y / 400;
+	int yoe = y - era * 400;
+	int doy = (153 * (month + ((month > 2) ? -3 : 9)) + 2) / 5 + day - 1;
+	int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	int64_t days = static_cast<int64_t>(era) * 146097 + doe - 719468;
+	return static_cast<uint32_t>(days * 86400 + hour * 3600 + minute * 60 + second);
+}
+
+
+
+
+
+/** Scans the raw CapturedStream file in a single pass, reading only the frame headers and skipping the
+frame data, and returns the index of all its I-frames.
+If the last frame is truncated (the dump was cut off), it is reported and left out of the index.
+Throws a std::runtime_error if the file is not a valid CapturedStream. */
+static std::vector<IndexEntry> buildIndex(FILE * aFile)
+{
+	auto fileSize = getFileSize(aFile);
+	if (!seekFile(aFile, 0, SEEK_SET))
+	{
+		throw std::runtime_error("Cannot seek to the start of the file");
+	}
+	std::vector<IndexEntry> res;
+	uint64_t offset = 0;
+	uint32_t frameNumber = 0;
+	while (true)
+	{
+		uint8_t hdr[16];
+		auto numRead = fread(hdr, 1, 8, aFile);
+		if (numRead == 0)
+		{
+			break;
+		}
+		if ((numRead < 8) || (hdr[0] != 0) || (hdr[1] != 0) || (hdr[2] != 1))
+		{
+			throw std::runtime_error(fmt::format("Invalid frame header at offset {}", offset));
+		}
+		uint64_t hdrSize = 8;
+		uint64_t dataSize;
+		switch (hdr[3])
+		{
+			case 0xfc:
+			{
+				// I-frame, 16-byte header: format, fps, width, height, packed timestamp, 4-byte length
+				if (fread(hdr + 8, 1, 8, aFile) != 8)
+				{
+					throw std::runtime_error(fmt::format("Truncated I-frame header at offset {}", offset));
+				}
+				hdrSize = 16;
+				dataSize = readLE(hdr + 12, 4);
+				res.push_back({offset, static_cast<uint32_t>(hdrSize + dataSize), unpackDeviceTime(static_cast<uint32_t>(readLE(hdr + 8, 4))), frameNumber});
+				frameNumber += 1;
+				break;
+			}
+			case 0xfd:
+			{
+				// P-frame, 8-byte header with a 4-byte length
+				dataSize = readLE(hdr + 4, 4);
+				frameNumber += 1;
+				break;
+			}
+			case 0xfa:
+			case 0xf9:
+			{
+				// Audio or info frame, 8-byte header with a 2-byte length
+				dataSize = readLE(hdr + 6, 2);
+				break;
+			}
+			default:
+			{
+				throw std::runtime_error(fmt::format("Unknown frame type {:02x} at offset {}", hdr[3], offset));
+			}
+		}
+		if (offset + hdrSize + dataSize > fileSize)
+		{
+			std::cerr << fmt::format("The frame at offset {} is truncated ({} bytes missing), the file ends there.\n",
+				offset, offset + hdrSize + dataSize - fileSize
+			);
+			if (!res.empty() && (res.back().mOffset == offset))
+			{
+				res.pop_back();
+			}
+			break;
+		}
+		if (!seekFile(aFile, static_cast<int64_t>(dataSize), SEEK_CUR))
+		{
+			throw std::runtime_error(fmt::format("Cannot skip frame data at offset {}", offset));
+		}
+		offset += hdrSize + dataSize;
+	}
+	return res;
+}
+
+
+
+
+
+/** Writes the index into the sidecar file. Returns true on success. */
+static bool writeIndex(const std::string & aFileName, const std::vector<IndexEntry> & aIndex)
+{
+	auto f = fopen(aFileName.c_str(), "wb");
+	if (f == nullptr)
+	{
+		return false;
+	}
+	std::vector<uint8_t> buf(sizeof(cIndexMagic) + 4 + aIndex.size() * 20);
+	memcpy(buf.data(), cIndexMagic, sizeof(cIndexMagic));
+	writeLE(buf.data() + 8, aIndex.size(), 4);
+	auto p = buf.data() + 12;
+	for (const auto & entry: aIndex)
+	{
+		writeLE(p, entry.mOffset, 8);
+		writeLE(p + 8, entry.mSize, 4);
+		writeLE(p + 12, entry.mTimeStamp, 4);
+		writeLE(p + 16, entry.mFrameNumber, 4);
+		p += 20;
+	}
+	auto isSuccess = (fwrite(buf.data(), 1, buf.size(), f) == buf.size());
+	fclose(f);
+	return isSuccess;
+}
+
+
+
+
+
+/** Reads the index from the sidecar file.
+Throws a std::runtime_error if the file cannot be read or is not a valid index. */
+static std::vector<IndexEntry> readIndex(const std::string & aFileName)
+{
+	auto f = fopen(aFileName.c_str(), "rb");
+	if (f == nullptr)
+	{
+		throw std::runtime_error("Cannot open index file " + aFileName);
+	}
+	uint8_t hdr[12];
+	if ((fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr)) || (memcmp(hdr, cIndexMagic, sizeof(cIndexMagic)) != 0))
+	{
+		fclose(f);
+		throw std::runtime_error("Not a valid index file: " + aFileName);
+	}
+	std::vector<uint8_t> buf(readLE(hdr + 8, 4) * 20);
+	auto numRead = fread(buf.data(), 1, buf.size(), f);
+	fclose(f);
+	if (numRead != buf.size())
+	{
+		throw std::runtime_error("Truncated index file: " + aFileName);
+	}
+	std::vector<IndexEntry> res(buf.size() / 20);
+	for (size_t i = 0; i < res.size(); ++i)
+	{
+		auto p = buf.data() + i * 20;
+		res[i] = {readLE(p, 8), static_cast<uint32_t>(readLE(p + 8, 4)), static_cast<uint32_t>(readLE(p + 12, 4)), static_cast<uint32_t>(readLE(p + 16, 4))};
+	}
+	return res;
+}
+
+
+
+
+
+/** Returns the index of the last I-frame at or before the specified time (the first one if all are later).
+The index must not be empty. */
+static size_t findKeyFrameByTime(const std::vector<IndexEntry> & aIndex, uint32_t aTimeStamp)
+{
+	auto itr = std::upper_bound(aIndex.begin(), aIndex.end(), aTimeStamp,
+		[](uint32_t aValue, const IndexEntry & aEntry)
+		{
+			return aValue < aEntry.mTimeStamp;
+		}
+	);
+	return (itr == aIndex.begin()) ? 0 : static_cast<size_t>(itr - aIndex.begin() - 1);
+}
+
+
+
+
+
+/** Returns the index of the last I-frame at or before the specified frame number (the first one if all are later).
+The index must not be empty. */
+static size_t findKeyFrameByNumber(const std::vector<IndexEntry> & aIndex, uint32_t aFrameNumber)
+{
+	auto itr = std::upper_bound(aIndex.begin(), aIndex.end(), aFrameNumber,
+		[](uint32_t aValue, const IndexEntry & aEntry)
+		{
+			return aValue < aEntry.mFrameNumber;
+		}
+	);
+	return (itr == aIndex.begin()) ? 0 : static_cast<size_t>(itr - aIndex.begin() - 1);
+}
+
+
+
+
+
+/** Feeds the raw file, starting at the specified offset, into the parser, up to aMaxBytes or the end of file.
+Throws a std::runtime_error if the offset is past the end of the file (the index doesn't match the file). */
+static void parseFrom(FILE * aFile, uint64_t aOffset, uint64_t aMaxBytes, NetSurveillancePp::CapturedStreamParser & aParser)
+{
+	auto fileSize = getFileSize(aFile);
+	if (aOffset > fileSize)
+	{
+		throw std::runtime_error(fmt::format("The offset {} is past the end of the file ({} bytes)", aOffset, fileSize));
+	}
+	if (!seekFile(aFile, static_cast<int64_t>(aOffset), SEEK_SET))
+	{
+		throw std::runtime_error(fmt::format("Cannot seek to offset {}", aOffset));
+	}
+	while (aMaxBytes > 0)
+	{
+		char buf[64 * 1024];
+		auto numBytesRead = fread(buf, 1, static_cast<size_t>(std::min<uint64_t>(sizeof(buf), aMaxBytes)), aFile);
+		if (numBytesRead == 0)
+		{
+			break;
+		}
+		aParser.parse(buf, numBytesRead);
+		aMaxBytes -= numBytesRead;
+	}
+}
+
+
+
+
+
+/** Checks the index against the raw file: parsing from each indexed offset must produce an I-frame first,
+and the number of I-frames must match a full sequential parse.
+Returns true if all checks pass. */
+static bool verifyIndex(FILE * aFile, const std::vector<IndexEntry> & aIndex)
+{
+	size_t numIFrames = 0;
+	size_t numFrames = 0;
+	{
+		NetSurveillancePp::CapturedStreamParser parser(
+			[&](const void *, size_t) { numIFrames += 1; numFrames += 1; },
+			[&](const void *, size_t) { numFrames += 1; }
+		);
+		parseFrom(aFile, 0, UINT64_MAX, parser);
+	}
+	if (numIFrames != aIndex.size())
+	{
+		std::cerr << fmt::format("The index has {} I-frames, the sequential parse found {}\n", aIndex.size(), numIFrames);
+		return false;
+	}
+	for (const auto & entry: aIndex)
+	{
+		size_t numIFramesHere = 0;
+		size_t numPFramesHere = 0;
+		NetSurveillancePp::CapturedStreamParser parser(
+			[&](const void *, size_t) { numIFramesHere += 1; },
+			[&](const void *, size_t) { numPFramesHere += 1; }
+		);
+		parseFrom(aFile, entry.mOffset, entry.mSize, parser);
+		if ((numIFramesHere != 1) || (numPFramesHere != 0) || parser.hasLeftoverData())
+		{
+			std::cerr << fmt::format("The indexed I-frame at offset {} doesn't parse as a single I-frame\n", entry.mOffset);
+			return false;
+		}
+	}
+	std::cout << fmt::format("The index matches the file: {} I-frames out of {} video frames\n", numIFrames, numFrames);
+	return true;
+}
+
+
+
+
+
+/** This test program builds a sidecar index of the I-frames in a raw CapturedStream file (from R15 real
+device test or test-09 / test-10), in a single pass reading only the frame headers, and saves it next to
+the file with an ".idx" suffix.
+The input file can be specified as the first param; defaults to "R15-out.raw" (as per R15's output).
+Without further params, the index is verified against the file (by parsing from each indexed offset).
+The second param can specify a seek position, either "t=<unixtime>" or "n=<frameNumber>"; the video is
+then extracted from the nearest preceding I-frame to the end of the file, using the saved index, into
+a file with a ".seek.h265" suffix (when seeking to a frame number, the number of frames that the player
+needs to decode and discard before the requested frame is printed). */
+int main(int argc, const char ** argv)
+{
+	std::string fileName = (argc > 1) ? argv[1] : "R15-out.raw";
+	std::string seekPos = (argc > 2) ? argv[2] : "";
+	auto fIn = fopen(fileName.c_str(), "rb");
+	if (fIn == nullptr)
+	{
+		std::cerr << "Failed to open input file " << fileName << std::endl;
+		return 1;
+	}
+
+	try
+	{
+		// Build and save the index:
+		auto index = buildIndex(fIn);
+		auto indexFileName = fileName + ".idx";
+		if (!writeIndex(indexFileName, index))
+		{
+			std::cerr << "Failed to write the index file " << indexFileName << std::endl;
+			return 1;
+		}
+		std::cout << fmt::format("Indexed {} I-frames into {}\n", index.size(), indexFileName);
+		if (index.empty())
+		{
+			std::cerr << "No I-frames found in the file." << std::endl;
+			return 2;
+		}
+
+		// Without a seek position, verify the index:
+		if (seekPos.empty())
+		{
+			return verifyIndex(fIn, readIndex(indexFileName)) ? 0 : 3;
+		}
+
+		// Seek using the saved index:
+		index = readIndex(indexFileName);
+		size_t entryIdx;
+		uint32_t numFramesToSkip = 0;
+		if (seekPos.compare(0, 2, "t=") == 0)
+		{
+			entryIdx = findKeyFrameByTime(index, static_cast<uint32_t>(std::stoul(seekPos.substr(2))));
+		}
+		else if (seekPos.compare(0, 2, "n=") == 0)
+		{
+			auto frameNumber = static_cast<uint32_t>(std::stoul(seekPos.substr(2)));
+			entryIdx = findKeyFrameByNumber(index, frameNumber);
+			if (frameNumber > index[entryIdx].mFrameNumber)
+			{
+				numFramesToSkip = frameNumber - index[entryIdx].mFrameNumber;
+			}
+		}
+		else
+		{
+			std::cerr << "Unknown seek position " << seekPos << ", use t=<unixtime> or n=<frameNumber>" << std::endl;
+			return 1;
+		}
+		const auto & entry = index[entryIdx];
+		auto outFileName = fileName + ".seek.h265";
+		auto fOut = fopen(outFileName.c_str(), "wb");
+		if (fOut == nullptr)
+		{
+			std::cerr << "Failed to open output file " << outFileName << std::endl;
+			return 1;
+		}
+		std::cout << fmt::format("Seeking to the I-frame at offset {}, frame number {}, time {}; the requested frame is {} frames after it\n",
+			entry.mOffset, entry.mFrameNumber, entry.mTimeStamp, numFramesToSkip
+		);
+		auto onFrame = [&](const void * aData, size_t aSize)
+		{
+			fwrite(aData, 1, aSize, fOut);
+		};
+		NetSurveillancePp::CapturedStreamParser parser(onFrame, onFrame);
+		parseFrom(fIn, entry.mOffset, UINT64_MAX, parser);
+		fclose(fOut);
+		return 0;
+	}
+	catch (const std::exception & exc)
+	{
+		std::cerr << "Exception: " << exc.what() << std::endl;
+		return 2;
+	}
+}
@@ -0,0 +1,518 @@
+#define _CRT_SECURE_NO_WARNINGS 1
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <vector>
+#include <iostream>
+#include "fmt/format.h"
+#include "CapturedStreamParser.hpp"
+#include "Recorder.hpp"
+#include "Root.hpp"
+
+
+
+
+
+using namespace NetSurveillancePp;
+
+using Clock = std::chrono::steady_clock;
+
+
+
+
+
+
+std::mutex gMtxFinished;
+std::condition_variable gCvFinished;
+bool gIsFinished = false;
+std::atomic_int gResult(0);
+
+/** The channel for which to record video on alarms. */
+int gChannel = 0;
+
+/** How much video before the alarm start should be saved. */
+std::chrono::seconds gPreRoll(5);
+
+/** How much video after the alarm stop should be saved. */
+std::chrono::seconds gPostRoll(5);
+
+/** The prefix of the output files' names. */
+std::string gOutFileNamePrefix;
+
+/** Number of clips to be recorded before exiting.
+If set to -1 (default), records indefinitely. */
+int gNumClipsLeft = -1;
+
+
+
+
+
+/** Signals the main thread that the program should terminate. */
+static void signalFinished()
+{
+	std::unique_lock<std::mutex> lg(gMtxFinished);
+	gIsFinished = true;
+	gCvFinished.notify_all();
+}
+
+
+
+
+
+/** A bounded buffer of the most recent video frames, used as the pre-roll of an alarm clip.
+Both the frame data and the frame bookkeeping are preallocated on construction, pushing frames never
+allocates. When full, the oldest frames are dropped. Frames older than the pre-roll are dropped
+whole-GOP-at-a-time, so that the buffer always starts with an I-frame once it has seen one. */
+class PreRollBuffer
+{
+public:
+
+	PreRollBuffer(size_t aCapacityBytes, size_t aMaxNumFrames):
+		mData(aCapacityBytes),
+		mDataHead(0),
+		mDataTail(0),
+		mFrames(aMaxNumFrames),
+		mFrameHead(0),
+		mFrameTail(0)
+	{
+	}
+
+
+	/** Adds the frame to the buffer, dropping the oldest frames if needed to make space.
+	Frames larger than the whole buffer are not stored and they clear the buffer (the following
+	P-frames would be useless without them). */
+	void push(const void * aData, size_t aSize, bool aIsIFrame, Clock::time_point aTimeStamp)
+	{
+		if (aSize > mData.size())
+		{
+			clear();
+			return;
+		}
+		while (
+			(mFrameHead - mFrameTail == mFrames.size()) ||
+			(mData.size() - (mDataHead - mDataTail) < aSize)
+		)
+		{
+			dropOldest();
+		}
+		auto start = mDataHead % mData.size();
+		auto firstPart = std::min(aSize, mData.size() - start);
+		memcpy(mData.data() + start, aData, firstPart);
+		memcpy(mData.data(), static_cast<const char *>(aData) + firstPart, aSize - firstPart);
+		mFrames[mFrameHead % mFrames.size()] = {mDataHead, aSize, aIsIFrame, aTimeStamp};
+		mDataHead += aSize;
+		mFrameHead += 1;
+	}
+
+
+	/** Drops the frames preceding the newest I-frame that is at or before aCutoff.
+	Keeps the buffer (in time) only as large as needed for a GOP-aligned pre-roll starting at aCutoff. */
+	void trimBefore(Clock::time_point aCutoff)
+	{
+		auto keepFrom = mFrameTail;
+		for (auto i = mFrameTail; i != mFrameHead; ++i)
+		{
+			const auto & frame = mFrames[i % mFrames.size()];
+			if (frame.mTimeStamp > aCutoff)
+			{
+				break;
+			}
+			if (frame.mIsIFrame)
+			{
+				keepFrom = i;
+			}
+		}
+		while (mFrameTail != keepFrom)
+		{
+			dropOldest();
+		}
+	}
+
+
+	/** Writes the buffered frames, starting with the first I-frame, into the file, then clears the buffer.
+	Returns true if any frames were written, false if the buffer had no I-frame. */
+	bool flushTo(FILE * aFile)
+	{
+		while ((mFrameTail != mFrameHead) && !mFrames[mFrameTail % mFrames.size()].mIsIFrame)
+		{
+			dropOldest();
+		}
+		if (mFrameTail != mFrameHead)
+		{
+			auto start = mDataTail % mData.size();
+			auto size = mDataHead - mDataTail;
+			auto firstPart = std::min(size, mData.size() - start);
+			fwrite(mData.data() + start, 1, firstPart, aFile);
+			fwrite(mData.data(), 1, size - firstPart, aFile);
+			clear();
+			return true;
+		}
+		clear();
+		return false;
+	}
+
+
+	/** Removes all frames from the buffer. */
+	void clear()
+	{
+		mDataTail = mDataHead;
+		mFrameTail = mFrameHead;
+	}
+
+
+protected:
+
+	/** Bookkeeping for a single frame stored in mData. */
+	struct Frame
+	{
+		/** The (unwrapped) position of the frame's data in mData. */
+		size_t mStart;
+
+		/** The size of the frame data. */
+		size_t mSize;
+
+		/** True for I-frames, false for P-frames. */
+		bool mIsIFrame;
+
+		/** When the frame was received. */
+		Clock::time_point mTimeStamp;
+	};
+
+
+	/** The ring buffer of the frame data. */
+	std::vector<char> mData;
+
+	/** The total number of bytes ever pushed into mData. */
+	size_t mDataHead;
+
+	/** The total number of bytes ever dropped from mData. */
+	size_t mDataTail;
+
+	/** The ring buffer of the frame bookkeeping. */
+	std::vector<Frame> mFrames;
+
+	/** The total number of frames ever pushed into mFrames. */
+	size_t mFrameHead;
+
+	/** The total number of frames ever dropped from mFrames. */
+	size_t mFrameTail;
+
+
+	/** Drops the oldest frame in the buffer. */
+	void dropOldest()
+	{
+		const auto & frame = mFrames[mFrameTail % mFrames.size()];
+		mDataTail = frame.mStart + frame.mSize;
+		mFrameTail += 1;
+	}
+};
+
+
+
+
+
+/** Records the clips of the video around alarms: buffers the pre-roll while idle, then writes the
+pre-roll, the live video and the post-roll into a new file for each alarm.
+All the methods are thread-safe. */
+class AlarmClipWriter
+{
+public:
+
+	AlarmClipWriter(size_t aPreRollCapacityBytes, size_t aPreRollMaxNumFrames):
+		mPreRoll(aPreRollCapacityBytes, aPreRollMaxNumFrames),
+		mState(State::Idle),
+		mNumActiveAlarms(0),
+		mFile(nullptr),
+		mIsWaitingForIFrame(false)
+	{
+	}
+
+
+	~AlarmClipWriter()
+	{
+		if (mFile != nullptr)
+		{
+			fclose(mFile);
+		}
+	}
+
+
+	/** Processes a single video frame, either buffering it as pre-roll or writing it to the current clip. */
+	void onFrame(const void * aData, size_t aSize, bool aIsIFrame)
+	{
+		if (aSize == 0)
+		{
+			return;
+		}
+		auto now = Clock::now();
+		std::unique_lock<std::mutex> lg(mMtx);
+
+		// Finish the clip once the post-roll has passed:
+		if ((mState == State::PostRoll) && (now >= mPostRollEnd))
+		{
+			finishClip();
+		}
+
+		if (mState == State::Idle)
+		{
+			if (aIsIFrame)
+			{
+				mPreRoll.trimBefore(now - gPreRoll);
+			}
+			mPreRoll.push(aData, aSize, aIsIFrame, now);
+		}
+		else
+		{
+			// A clip must start with an I-frame, the decoder cannot use the P-frames before it:
+			if (mIsWaitingForIFrame && !aIsIFrame)
+			{
+				return;
+			}
+			mIsWaitingForIFrame = false;
+			fwrite(aData, 1, aSize, mFile);
+		}
+	}
+
+
+	/** Finishes the clip if the post-roll has passed, even if no frames are arriving.
+	To be called periodically. */
+	void onTimer()
+	{
+		std::unique_lock<std::mutex> lg(mMtx);
+		if ((mState == State::PostRoll) && (Clock::now() >= mPostRollEnd))
+		{
+			finishClip();
+		}
+	}
+
+
+	/** Processes a single alarm event for the recorded channel. */
+	void onAlarm(bool aIsStart)
+	{
+		std::unique_lock<std::mutex> lg(mMtx);
+		if (aIsStart)
+		{
+			if ((mState == State::Idle) && !startClip())
+			{
+				return;
+			}
+			mNumActiveAlarms += 1;
+			mState = State::Recording;
+		}
+		else
+		{
+			if (mNumActiveAlarms > 0)
+			{
+				mNumActiveAlarms -= 1;
+			}
+			if ((mNumActiveAlarms == 0) && (mState == State::Recording))
+			{
+				mState = State::PostRoll;
+				mPostRollEnd = Clock::now() + gPostRoll;
+			}
+		}
+	}
+
+
+protected:
+
+	enum class State
+	{
+		Idle,       ///< No alarm, buffering the pre-roll
+		Recording,  ///< An alarm is active, writing to mFile
+		PostRoll,   ///< All alarms have stopped, writing to mFile until mPostRollEnd
+	};
+
+	/** Protects all the member variables against multithreaded access. */
+	std::mutex mMtx;
+
+	/** The frames received while idle. */
+	PreRollBuffer mPreRoll;
+
+	/** The current state of the recording. */
+	State mState;
+
+	/** The number of alarms that have started and not yet stopped. */
+	int mNumActiveAlarms;
+
+	/** When the post-roll should end (valid only in the PostRoll state). */
+	Clock::time_point mPostRollEnd;
+
+	/** The file into which the current clip is being written, nullptr when idle. */
+	FILE * mFile;
+
+	/** True if the clip has no I-frame yet (the pre-roll had none), the P-frames are skipped until one arrives. */
+	bool mIsWaitingForIFrame;
+
+
+	/** Opens a new clip file and writes the pre-roll into it.
+	Returns true on success, false if the file cannot be opened. */
+	bool startClip()
+	{
+		// The CapturedStreamParser doesn't report the codec, use the same .h265 extension as 08-ParseRawCapturedStream:
+		auto now = time(nullptr);
+		char timeStr[32];
+		strftime(timeStr, sizeof(timeStr), "%Y%m%d-%H%M%S", localtime(&now));
+		auto fileName = fmt::format("{}-{}.h265", gOutFileNamePrefix, timeStr);
+		mFile = fopen(fileName.c_str(), "wb");
+		if (mFile == nullptr)
+		{
+			std::cerr << "Cannot open output file " << fileName << std::endl;
+			gResult = 3;
+			signalFinished();
+			return false;
+		}
+		std::cout << "Alarm started, recording into " << fileName << std::endl;
+		mPreRoll.trimBefore(Clock::now() - gPreRoll);
+		mIsWaitingForIFrame = !mPreRoll.flushTo(mFile);
+		return true;
+	}
+
+
+	/** Closes the current clip file and goes back to buffering the pre-roll. */
+	void finishClip()
+	{
+		std::cout << "Alarm clip finished." << std::endl;
+		fclose(mFile);
+		mFile = nullptr;
+		mState = State::Idle;
+		if (gNumClipsLeft > 0)
+		{
+			gNumClipsLeft -= 1;
+			if (gNumClipsLeft == 0)
+			{
+				signalFinished();
+			}
+		}
+	}
+};
+
+
+
+
+
+/** This tool connects to the NVR specified on the commandline, keeps a pre-roll buffer of the live video
+of the specified channel and saves a clip of the video around each alarm reported on that channel.
+Command-line parameters:
+	1. NVR hostname
+	2. NVR port
+	3. NVR username
+	4. NVR password
+	5. Channel to record
+	6. Output file name prefix (the clip's start time and extension are appended)
+	7. Pre-roll, in seconds
+	8. Post-roll, in seconds
+	9. Pre-roll buffer size limit, in KiB
+	10. Number of clips to record before exiting (-1 for unlimited)
+*/
+int main(int aArgC, char * aArgV[])
+{
+	// Parse the cmdline arguments:
+	auto hostName       = (aArgC < 2) ? "localhost" : aArgV[1];
+	auto portStr        = (aArgC < 3) ? "34567" : aArgV[2];
+	auto userName       = (aArgC < 4) ? "builtinUser" : aArgV[3];
+	auto password       = (aArgC < 5) ? "builtinPassword" : aArgV[4];
+	gChannel            = (aArgC < 6) ? 0 : std::atoi(aArgV[5]);
+	gOutFileNamePrefix  = (aArgC < 7) ? "alarm" : aArgV[6];
+	gPreRoll            = std::chrono::seconds((aArgC < 8) ? 5 : std::atoi(aArgV[7]));
+	gPostRoll           = std::chrono::seconds((aArgC < 9) ? 5 : std::atoi(aArgV[8]));
+	auto preRollSizeKiB = (aArgC < 10) ? 16384 : std::atoi(aArgV[9]);
+	gNumClipsLeft       = (aArgC < 11) ? -1 : std::atoi(aArgV[10]);
+	auto port = std::atoi(portStr);
+	if (port == 0)
+	{
+		std::cerr << "Cannot parse port, using default 34567 instead\n";
+		port = 34567;
+	}
+
+	// The frame bookkeeping allows for 100 fps over the pre-roll, plus 10 seconds' worth for the GOP alignment:
+	AlarmClipWriter writer(static_cast<size_t>(preRollSizeKiB) * 1024, static_cast<size_t>(gPreRoll.count() + 10) * 100);
+	CapturedStreamParser csp(
+		[&writer](const void * aData, size_t aSize)
+		{
+			writer.onFrame(aData, aSize, true);
+		},
+		[&writer](const void * aData, size_t aSize)
+		{
+			writer.onFrame(aData, aSize, false);
+		}
+	);
+
+	std::cout << "Connecting to " << hostName << " : " << port << " using credentials " << userName << " / " << password << "...\n";
+	auto rec = Recorder::create();
+	rec->connectAndLogin(hostName, port, userName, password,
+		[&](const std::error_code & aError)
+		{
+			if (aError)
+			{
+				std::cerr << "Error: " << aError.message() << "\n";
+				gResult = 1;
+				signalFinished();
+				return;
+			}
+			std::cout << fmt::format("Logged in, buffering channel {} and monitoring alarms...\n", gChannel);
+			rec->receiveLiveVideo(
+				[&](const std::error_code & aVideoError, const void * aData, size_t aSize)
+				{
+					if (aVideoError)
+					{
+						std::cerr << "Error while receiving video: " << aVideoError.message() << "\n";
+						gResult = 2;
+						signalFinished();
+						return;
+					}
+					try
+					{
+						csp.parse(aData, aSize);
+					}
+					catch (const std::exception & exc)
+					{
+						std::cerr << "Parsing CapturedStream failed: " << exc.what() << "\n";
+						gResult = 2;
+						signalFinished();
+					}
+				},
+				gChannel
+			);
+			rec->monitorAlarms(
+				[&](
+					const std::error_code & aAlarmError,
+					int aChannel,
+					bool aIsStart,
+					const std::string & aEventType,
+					const nlohmann::json & /* aWholeJson */
+				)
+				{
+					if (aAlarmError)
+					{
+						std::cerr << "Error while monitoring alarms: " << aAlarmError.message() << "\n";
+						gResult = 2;
+						signalFinished();
+						return;
+					}
+					std::cout << fmt::format("Alarm received: Channel {}, IsStart: {}, EventType: {}\n", aChannel, aIsStart ? "true" : "false", aEventType);
+					if (aChannel == gChannel)
+					{
+						writer.onAlarm(aIsStart);
+					}
+				}
+			);
+		}
+	);
+
+	// Wait for completion, finishing the clip once its post-roll has passed even if the video stalls:
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lg(gMtxFinished);
+			if (gCvFinished.wait_for(lg, std::chrono::seconds(1), []() { return gIsFinished; }))
+			{
+				break;
+			}
+		}
+		writer.onTimer();
+	}
+
+	return gResult.load();
+}
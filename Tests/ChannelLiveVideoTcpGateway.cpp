@@ -1,4 +1,12 @@
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <array>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <chrono>
+#include <vector>
 #include <iostream>
 #include "CapturedStreamParser.hpp"
 #include "Recorder.hpp"
@@ -30,62 +38,1485 @@ std::string gNvrPassword;
 /** The channel for which to request the video stream. */
 int gNvrChannel = 0;
 
+/** The size of the frame queue between the network thread and the local socket writer, in bytes.
+If zero, the video frames are written to the local socket directly from the network thread. */
+size_t gQueueSize = 0;
 
+/** The minimum non-zero size of the frame queue, in KiB. The queue needs to hold at least a whole I-frame. */
+static const size_t cMinQueueSizeKiB = 1024;
 
+/** If true, only the video I-frames are relayed to the local client, the P-frames are discarded.
+Useful for overview walls that need about one picture per GOP and not the full bitrate. */
+bool gKeyFramesOnly = false;
 
+/** The format in which the video is sent to the local client. */
+enum class OutputFormat
+{
+	ElementaryStream,  ///< The raw H.264 / H.265 video frames, as output by CapturedStreamParser
+	MpegTs,            ///< MPEG transport stream, sent as-is over the TCP connection
+	HttpMpegTs,        ///< MPEG transport stream, served as a response to a HTTP request, using chunked transfer
+	Fmp4,              ///< Fragmented MP4, sent as-is over the TCP connection
+	HttpFmp4,          ///< Fragmented MP4, served as a response to a HTTP request, using chunked transfer
+} gOutputFormat = OutputFormat::ElementaryStream;
 
-void relayOnSocket(asio::ip::tcp::socket & aLocalSocket)
+/** Returns true if the output is served as a response to a HTTP request. */
+static bool isHttpOutput()
 {
-	std::cout << "Client connected: " << aLocalSocket.remote_endpoint() << std::endl;
-	auto onVideoFrame = [&aLocalSocket](const void * aData, size_t aSize)
+	return (gOutputFormat == OutputFormat::HttpMpegTs) || (gOutputFormat == OutputFormat::HttpFmp4);
+}
+
+/** The interval, in seconds, in which the stream statistics are printed; 0 to disable. */
+int gStatsInterval = 0;
+
+
+
+
+
+/** A lock-free single-producer single-consumer ring buffer of whole video frames.
+The producer is the network thread (CapturedStreamParser callbacks), the consumer is the thread
+writing into the local socket. Each frame is stored as a 4-byte size followed by the frame data,
+possibly wrapping around the end of the buffer. */
+class SpscFrameRing
+{
+public:
+
+	SpscFrameRing(size_t aCapacity):
+		mBuffer(aCapacity),
+		mHead(0),
+		mTail(0)
+	{
+	}
+
+
+	/** Returns the size of the largest frame that can ever fit into the ring. */
+	size_t maxFrameSize() const
+	{
+		return mBuffer.size() - sizeof(uint32_t);
+	}
+
+
+	/** Copies the whole frame into the ring.
+	Returns false if there's not enough free space for the frame; the ring is left unchanged then.
+	Must only be called from the producer thread. */
+	bool push(const void * aData, size_t aSize)
+	{
+		auto needed = sizeof(uint32_t) + aSize;
+		auto head = mHead.load(std::memory_order_relaxed);
+		auto tail = mTail.load(std::memory_order_acquire);
+		if (mBuffer.size() - (head - tail) < needed)
+		{
+			return false;
+		}
+		auto size32 = static_cast<uint32_t>(aSize);
+		copyIn(head, &size32, sizeof(size32));
+		copyIn(head + sizeof(size32), aData, aSize);
+		mHead.store(head + needed, std::memory_order_release);
+		return true;
+	}
+
+
+	/** Calls aCallback with the oldest frame in the ring, as an array of two asio::const_buffer
+	(the second one is non-empty only if the frame wraps around the end of the ring), then removes
+	the frame from the ring.
+	Returns false if the ring is empty.
+	Must only be called from the consumer thread. */
+	template <typename Callback>
+	bool consume(Callback && aCallback)
+	{
+		auto tail = mTail.load(std::memory_order_relaxed);
+		auto head = mHead.load(std::memory_order_acquire);
+		if (head == tail)
+		{
+			return false;
+		}
+		uint32_t size32;
+		copyOut(tail, &size32, sizeof(size32));
+		auto start = (tail + sizeof(size32)) % mBuffer.size();
+		auto firstPart = std::min<size_t>(size32, mBuffer.size() - start);
+		std::array<asio::const_buffer, 2> buffers =
+		{
+			asio::const_buffer(mBuffer.data() + start, firstPart),
+			asio::const_buffer(mBuffer.data(), size32 - firstPart)
+		};
+		aCallback(buffers);
+		mTail.store(tail + sizeof(size32) + size32, std::memory_order_release);
+		return true;
+	}
+
+
+protected:
+
+	/** The ring storage. */
+	std::vector<char> mBuffer;
+
+	/** The total number of bytes ever pushed into the ring; written only by the producer. */
+	std::atomic<size_t> mHead;
+
+	/** The total number of bytes ever consumed from the ring; written only by the consumer. */
+	std::atomic<size_t> mTail;
+
+
+	/** Copies the data into the ring at the specified (unwrapped) position. */
+	void copyIn(size_t aPos, const void * aData, size_t aSize)
+	{
+		auto start = aPos % mBuffer.size();
+		auto firstPart = std::min(aSize, mBuffer.size() - start);
+		memcpy(mBuffer.data() + start, aData, firstPart);
+		memcpy(mBuffer.data(), static_cast<const char *>(aData) + firstPart, aSize - firstPart);
+	}
+
+
+	/** Copies the data out of the ring from the specified (unwrapped) position. */
+	void copyOut(size_t aPos, void * aData, size_t aSize) const
+	{
+		auto start = aPos % mBuffer.size();
+		auto firstPart = std::min(aSize, mBuffer.size() - start);
+		memcpy(aData, mBuffer.data() + start, firstPart);
+		memcpy(static_cast<char *>(aData) + firstPart, mBuffer.data(), aSize - firstPart);
+	}
+};
+
+
+
+
+
+/** The health statistics of a single stream.
+The counters are updated by the network thread only, using relaxed atomics, so that they can be sampled
+from any other thread at any time without locking. The relay only creates the stats when they are printed.
+The rates (bytes / sec, frames / sec) are computed by the sampler from the difference between two samples. */
+class StreamStats
+{
+public:
+
+	/** A snapshot of the counters. */
+	struct Sample
+	{
+		std::chrono::steady_clock::time_point mTime;
+		uint64_t mNumBytes;
+		uint64_t mNumFrames;
+		uint64_t mNumIFrames;
+		uint64_t mLastIFrameSize;
+		uint64_t mLastGopLength;
+		uint64_t mJitterUsec;
+	};
+
+
+	StreamStats():
+		mNumBytes(0),
+		mNumFrames(0),
+		mNumIFrames(0),
+		mLastIFrameSize(0),
+		mLastGopLength(0),
+		mJitterUsec(0),
+		mHasLastPacket(false),
+		mMeanInterArrivalUsec(0),
+		mJitterUsecLocal(0),
+		mNumFramesSinceIFrame(0)
+	{
+	}
+
+
+	/** Updates the counters with a CapturedStream data packet received from the NVR.
+	Network thread only. */
+	void onPacket(size_t aSize)
+	{
+		auto now = std::chrono::steady_clock::now();
+		mNumBytes.store(mNumBytes.load(std::memory_order_relaxed) + aSize, std::memory_order_relaxed);
+		if (mHasLastPacket)
+		{
+			// Smoothed deviation of the packet inter-arrival time from its smoothed mean, with the same 1/16 gain as RFC 3550:
+			auto interArrival = static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>(now - mLastPacket).count());
+			mMeanInterArrivalUsec += (interArrival - mMeanInterArrivalUsec) / 16;
+			mJitterUsecLocal += (std::abs(interArrival - mMeanInterArrivalUsec) - mJitterUsecLocal) / 16;
+			mJitterUsec.store(static_cast<uint64_t>(mJitterUsecLocal), std::memory_order_relaxed);
+		}
+		mHasLastPacket = true;
+		mLastPacket = now;
+	}
+
+
+	/** Updates the counters with a parsed video frame.
+	Network thread only. */
+	void onFrame(size_t aSize, bool aIsIFrame)
+	{
+		mNumFrames.store(mNumFrames.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		if (aIsIFrame)
+		{
+			mNumIFrames.store(mNumIFrames.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			mLastIFrameSize.store(aSize, std::memory_order_relaxed);
+			if (mNumFramesSinceIFrame > 0)
+			{
+				mLastGopLength.store(mNumFramesSinceIFrame, std::memory_order_relaxed);
+			}
+			mNumFramesSinceIFrame = 0;
+		}
+		mNumFramesSinceIFrame += 1;
+	}
+
+
+	/** Returns the current values of the counters. Callable from any thread. */
+	Sample sample() const
+	{
+		return
+		{
+			std::chrono::steady_clock::now(),
+			mNumBytes.load(std::memory_order_relaxed),
+			mNumFrames.load(std::memory_order_relaxed),
+			mNumIFrames.load(std::memory_order_relaxed),
+			mLastIFrameSize.load(std::memory_order_relaxed),
+			mLastGopLength.load(std::memory_order_relaxed),
+			mJitterUsec.load(std::memory_order_relaxed),
+		};
+	}
+
+
+protected:
+
+	// The sampled counters:
+	std::atomic<uint64_t> mNumBytes;
+	std::atomic<uint64_t> mNumFrames;
+	std::atomic<uint64_t> mNumIFrames;
+	std::atomic<uint64_t> mLastIFrameSize;
+	std::atomic<uint64_t> mLastGopLength;
+	std::atomic<uint64_t> mJitterUsec;
+
+	// The network thread's working state:
+	bool mHasLastPacket;
+	std::chrono::steady_clock::time_point mLastPacket;
+	double mMeanInterArrivalUsec;
+	double mJitterUsecLocal;
+	uint64_t mNumFramesSinceIFrame;
+};
+
+
+
+
+
+/** Packs the video frames into an MPEG transport stream, one PES packet per frame.
+The codec (H.264 or H.265) is detected from the first I-frame; frames before it are dropped. The PAT and
+PMT are repeated before each I-frame, so that a client can start decoding at any I-frame.
+The output buffer is reused for all frames, so once it has grown to the largest frame's size, muxing
+doesn't allocate anymore. */
+class TsMuxer
+{
+public:
+
+	TsMuxer():
+		mStreamType(0),
+		mCcPat(0),
+		mCcPmt(0),
+		mCcVideo(0)
+	{
+		mOut.reserve(1024 * 1024);
+	}
+
+
+	/** Muxes the frame with the specified timestamp (in 90 kHz units) into TS packets.
+	Returns the TS packets, valid until the next call; empty if the frame was dropped. */
+	const std::vector<uint8_t> & mux(const void * aData, size_t aSize, bool aIsIFrame, uint64_t aTimeStamp90k)
+	{
+		mOut.clear();
+		auto data = static_cast<const uint8_t *>(aData);
+		if (mStreamType == 0)
+		{
+			if (!aIsIFrame)
+			{
+				return mOut;
+			}
+			mStreamType = detectStreamType(data, aSize);
+		}
+		if (aIsIFrame)
+		{
+			writePat();
+			writePmt();
+		}
+
+		// The PCR lags the PTS by 100 msec, to give the client's decoder some leeway:
+		uint64_t pcr = aTimeStamp90k;
+		uint64_t pts = aTimeStamp90k + 9000;
+		uint8_t pesHeader[14] =
+		{
+			0x00, 0x00, 0x01, 0xe0,  // Start code, video stream 0
+			0x00, 0x00,              // PES packet length, unbounded for video
+			0x80, 0x80, 0x05,        // Flags: PTS only, header data length
+			static_cast<uint8_t>(0x21 | ((pts >> 29) & 0x0e)),
+			static_cast<uint8_t>(pts >> 22),
+			static_cast<uint8_t>(((pts >> 14) & 0xfe) | 0x01),
+			static_cast<uint8_t>(pts >> 7),
+			static_cast<uint8_t>(((pts << 1) & 0xfe) | 0x01),
+		};
+
+		// Split the PES header + frame data into TS packets, the first one carries the PCR:
+		size_t total = sizeof(pesHeader) + aSize;
+		size_t pos = 0;
+		bool isFirst = true;
+		while (pos < total)
+		{
+			auto pkt = appendPacket();
+			size_t afMin = isFirst ? 8 : 0;  // Adaptation field length byte, flags, 6 bytes PCR
+			size_t remaining = total - pos;
+			size_t afTotal = (remaining < 184 - afMin) ? (184 - remaining) : afMin;
+			pkt[0] = 0x47;
+			pkt[1] = static_cast<uint8_t>((isFirst ? 0x40 : 0x00) | (cVideoPid >> 8));
+			pkt[2] = static_cast<uint8_t>(cVideoPid & 0xff);
+			pkt[3] = static_cast<uint8_t>(((afTotal > 0) ? 0x30 : 0x10) | mCcVideo);
+			mCcVideo = (mCcVideo + 1) & 0x0f;
+			size_t p = 4;
+			if (afTotal > 0)
+			{
+				pkt[p++] = static_cast<uint8_t>(afTotal - 1);
+				if (afTotal > 1)
+				{
+					pkt[p++] = static_cast<uint8_t>((isFirst ? 0x10 : 0x00) | ((isFirst && aIsIFrame) ? 0x40 : 0x00));
+					if (isFirst)
+					{
+						pkt[p++] = static_cast<uint8_t>(pcr >> 25);
+						pkt[p++] = static_cast<uint8_t>(pcr >> 17);
+						pkt[p++] = static_cast<uint8_t>(pcr >> 9);
+						pkt[p++] = static_cast<uint8_t>(pcr >> 1);
+						pkt[p++] = static_cast<uint8_t>(((pcr & 0x01) << 7) | 0x7e);
+						pkt[p++] = 0x00;
+					}
+					memset(pkt + p, 0xff, 4 + afTotal - p);
+					p = 4 + afTotal;
+				}
+			}
+
+			// Copy the payload, first from the PES header, then from the frame data:
+			while ((p < 188) && (pos < total))
+			{
+				if (pos < sizeof(pesHeader))
+				{
+					auto n = std::min(188 - p, sizeof(pesHeader) - pos);
+					memcpy(pkt + p, pesHeader + pos, n);
+					p += n;
+					pos += n;
+				}
+				else
+				{
+					auto n = std::min(188 - p, total - pos);
+					memcpy(pkt + p, data + (pos - sizeof(pesHeader)), n);
+					p += n;
+					pos += n;
+				}
+			}
+			isFirst = false;
+		}
+		return mOut;
+	}
+
+
+protected:
+
+	/** The PID of the PMT. */
+	static const uint16_t cPmtPid = 0x1000;
+
+	/** The PID of the video elementary stream, also carries the PCR. */
+	static const uint16_t cVideoPid = 0x100;
+
+	/** The output TS packets. */
+	std::vector<uint8_t> mOut;
+
+	/** The PMT stream type of the video (0x1b for H.264, 0x24 for H.265), 0 until the first I-frame. */
+	uint8_t mStreamType;
+
+	/** The continuity counters of the PAT, PMT and video PIDs. */
+	uint8_t mCcPat, mCcPmt, mCcVideo;
+
+
+	/** Detects the PMT stream type from the first NAL unit of an I-frame: H.265 I-frames start with
+	a VPS (40 01), H.264 ones with an SPS. */
+	static uint8_t detectStreamType(const uint8_t * aData, size_t aSize)
+	{
+		for (size_t i = 0; i + 4 < aSize; ++i)
+		{
+			if ((aData[i] == 0) && (aData[i + 1] == 0) && (aData[i + 2] == 1))
+			{
+				return ((aData[i + 3] == 0x40) && (aData[i + 4] == 0x01)) ? 0x24 : 0x1b;
+			}
+		}
+		return 0x1b;
+	}
+
+
+	/** Appends a new 188-byte TS packet to mOut, returns the pointer to its first byte. */
+	uint8_t * appendPacket()
+	{
+		auto size = mOut.size();
+		mOut.resize(size + 188);
+		return mOut.data() + size;
+	}
+
+
+	/** Appends a TS packet containing the specified PSI section (without the CRC, which is appended). */
+	void writePsi(uint16_t aPid, uint8_t & aCc, const uint8_t * aSection, size_t aSize)
+	{
+		auto pkt = appendPacket();
+		pkt[0] = 0x47;
+		pkt[1] = static_cast<uint8_t>(0x40 | (aPid >> 8));
+		pkt[2] = static_cast<uint8_t>(aPid & 0xff);
+		pkt[3] = static_cast<uint8_t>(0x10 | aCc);
+		aCc = (aCc + 1) & 0x0f;
+		pkt[4] = 0x00;  // Pointer field
+		memcpy(pkt + 5, aSection, aSize);
+		auto crc = crc32(aSection, aSize);
+		pkt[5 + aSize] = static_cast<uint8_t>(crc >> 24);
+		pkt[6 + aSize] = static_cast<uint8_t>(crc >> 16);
+		pkt[7 + aSize] = static_cast<uint8_t>(crc >> 8);
+		pkt[8 + aSize] = static_cast<uint8_t>(crc);
+		memset(pkt + 9 + aSize, 0xff, 188 - 9 - aSize);
+	}
+
+
+	/** Appends the PAT, announcing a single program with the PMT on cPmtPid. */
+	void writePat()
+	{
+		const uint8_t section[] =
+		{
+			0x00, 0xb0, 13,          // Table ID, section syntax, section length
+			0x00, 0x01, 0xc1,        // Transport stream ID, version 0, current
+			0x00, 0x00,              // Section number, last section number
+			0x00, 0x01,              // Program number 1
+			static_cast<uint8_t>(0xe0 | (cPmtPid >> 8)), static_cast<uint8_t>(cPmtPid & 0xff),
+		};
+		writePsi(0, mCcPat, section, sizeof(section));
+	}
+
+
+	/** Appends the PMT, announcing the single video stream on cVideoPid. */
+	void writePmt()
+	{
+		const uint8_t section[] =
+		{
+			0x02, 0xb0, 18,          // Table ID, section syntax, section length
+			0x00, 0x01, 0xc1,        // Program number 1, version 0, current
+			0x00, 0x00,              // Section number, last section number
+			static_cast<uint8_t>(0xe0 | (cVideoPid >> 8)), static_cast<uint8_t>(cVideoPid & 0xff),  // PCR PID
+			0xf0, 0x00,              // Program info length
+			mStreamType,
+			static_cast<uint8_t>(0xe0 | (cVideoPid >> 8)), static_cast<uint8_t>(cVideoPid & 0xff),
+			0xf0, 0x00,              // ES info length
+		};
+		writePsi(cPmtPid, mCcPmt, section, sizeof(section));
+	}
+
+
+	/** Calculates the MPEG-2 CRC32 of the PSI section. */
+	static uint32_t crc32(const uint8_t * aData, size_t aSize)
+	{
+		uint32_t crc = 0xffffffff;
+		for (size_t i = 0; i < aSize; ++i)
+		{
+			crc ^= static_cast<uint32_t>(aData[i]) << 24;
+			for (int bit = 0; bit < 8; ++bit)
+			{
+				crc = (crc & 0x80000000) ? ((crc << 1) ^ 0x04c11db7) : (crc << 1);
+			}
+		}
+		return crc;
+	}
+};
+
+
+
+
+
+/** Reads the bits of a NAL unit's RBSP (the payload with the emulation prevention bytes removed), MSB first.
+Reading past the end yields zero bits, a truncated parameter set results in bogus values rather than a crash. */
+class RbspReader
+{
+public:
+
+	/** Converts the NAL unit payload (after the NAL header) into the RBSP, stored in the (reused) aBuffer. */
+	RbspReader(const uint8_t * aData, size_t aSize, std::vector<uint8_t> & aBuffer):
+		mRbsp(aBuffer),
+		mBitPos(0)
+	{
+		mRbsp.clear();
+		size_t numZeros = 0;
+		for (size_t i = 0; i < aSize; ++i)
+		{
+			if ((numZeros >= 2) && (aData[i] == 3))
+			{
+				numZeros = 0;
+				continue;
+			}
+			numZeros = (aData[i] == 0) ? (numZeros + 1) : 0;
+			mRbsp.push_back(aData[i]);
+		}
+	}
+
+
+	/** Reads an unsigned number of the specified bit width (at most 32). */
+	uint32_t bits(unsigned aCount)
+	{
+		uint32_t res = 0;
+		for (unsigned i = 0; i < aCount; ++i)
+		{
+			auto bytePos = mBitPos / 8;
+			auto bit = (bytePos < mRbsp.size()) ? ((mRbsp[bytePos] >> (7 - mBitPos % 8)) & 1) : 0;
+			res = (res << 1) | bit;
+			mBitPos += 1;
+		}
+		return res;
+	}
+
+
+	/** Skips the specified number of bits. */
+	void skip(size_t aCount)
+	{
+		mBitPos += aCount;
+	}
+
+
+	/** Reads an unsigned Exp-Golomb-coded number. */
+	uint32_t ue()
+	{
+		unsigned numLeadingZeros = 0;
+		while ((bits(1) == 0) && (numLeadingZeros < 32))
+		{
+			numLeadingZeros += 1;
+		}
+		if (numLeadingZeros >= 32)
+		{
+			return 0;
+		}
+		return ((1u << numLeadingZeros) - 1) + bits(numLeadingZeros);
+	}
+
+
+	/** Reads a signed Exp-Golomb-coded number. */
+	int32_t se()
 	{
+		auto v = ue();
+		return (v & 1) ? static_cast<int32_t>((v + 1) / 2) : -static_cast<int32_t>(v / 2);
+	}
+
+
+protected:
+
+	std::vector<uint8_t> & mRbsp;
+	size_t mBitPos;
+};
+
+
+
+
+
+/** Packs the video frames into a fragmented MP4 stream: an initialization segment (ftyp + moov, with the
+avcC / hvcC built from the first I-frame's parameter sets), followed by one fragment (moof + mdat) per frame.
+The codec (H.264 or H.265) is detected from the first I-frame; frames before it are dropped. The parameter
+sets are carried only in the initialization segment, the in-band ones are stripped from the samples.
+Each frame's duration is the previous frame's inter-arrival time; the fragments carry their absolute decode
+time (tfdt), so the players stay in sync regardless.
+The output and sample buffers are reused for all frames, so once they have grown to the largest frame's
+size, muxing doesn't allocate anymore. */
+class Fmp4Muxer
+{
+public:
+
+	Fmp4Muxer():
+		mIsHevc(false),
+		mIsInitialized(false),
+		mFirstTimeStamp(0),
+		mLastTimeStamp(0),
+		mLastDuration(cDefaultDuration),
+		mSequenceNumber(0)
+	{
+		mOut.reserve(1024 * 1024);
+		mSample.reserve(1024 * 1024);
+	}
+
+
+	/** Muxes the frame with the specified timestamp (in 90 kHz units) into a fragment, preceded by the
+	initialization segment for the first I-frame.
+	Returns the output data, valid until the next call; empty if the frame was dropped. */
+	const std::vector<uint8_t> & mux(const void * aData, size_t aSize, bool aIsIFrame, uint64_t aTimeStamp90k)
+	{
+		mOut.clear();
+		auto data = static_cast<const uint8_t *>(aData);
+		if (!mIsInitialized)
+		{
+			if (!aIsIFrame || !writeInitSegment(data, aSize))
+			{
+				mOut.clear();
+				return mOut;
+			}
+			mIsInitialized = true;
+			mFirstTimeStamp = aTimeStamp90k;
+			mLastTimeStamp = aTimeStamp90k;
+		}
+		if (aTimeStamp90k > mLastTimeStamp)
+		{
+			mLastDuration = aTimeStamp90k - mLastTimeStamp;
+			mLastTimeStamp = aTimeStamp90k;
+		}
+		buildSample(data, aSize);
+		if (mSample.empty())
+		{
+			// Nothing but parameter sets, there's no picture to send (only the init segment, if just written):
+			return mOut;
+		}
+		writeFragment(aIsIFrame, mLastTimeStamp - mFirstTimeStamp);
+		return mOut;
+	}
+
+
+protected:
+
+	/** The timescale of the video track, matching the 90 kHz timestamps. */
+	static const uint32_t cTimeScale = 90000;
+
+	/** The duration of the first frame, before any inter-arrival time is known (25 fps). */
+	static const uint64_t cDefaultDuration = 3600;
+
+	/** The decoded properties of the SPS needed for the sample entry. */
+	struct SpsInfo
+	{
+		uint32_t mWidth = 0;
+		uint32_t mHeight = 0;
+		uint32_t mChromaFormat = 1;
+		uint32_t mBitDepthLumaMinus8 = 0;
+		uint32_t mBitDepthChromaMinus8 = 0;
+
+		// H.265 only:
+		uint8_t mProfileTierLevel[12] = {};
+		uint32_t mMaxSubLayersMinus1 = 0;
+		uint32_t mTemporalIdNesting = 0;
+	};
+
+	/** The output data. */
+	std::vector<uint8_t> mOut;
+
+	/** The current frame, converted to length-prefixed NAL units. */
+	std::vector<uint8_t> mSample;
+
+	/** The buffer for the parameter sets' RBSP. */
+	std::vector<uint8_t> mRbsp;
+
+	/** True if the stream is H.265, false for H.264. Valid once initialized. */
+	bool mIsHevc;
+
+	/** True once the initialization segment has been written. */
+	bool mIsInitialized;
+
+	/** The timestamp of the first frame, the decode times are relative to it. */
+	uint64_t mFirstTimeStamp;
+
+	/** The timestamp of the last frame. */
+	uint64_t mLastTimeStamp;
+
+	/** The duration used for the current frame, in 90 kHz units. */
+	uint64_t mLastDuration;
+
+	/** The sequence number of the last fragment written. */
+	uint32_t mSequenceNumber;
+
+
+	/** Calls aCallback for each NAL unit in the Annex-B data, without the start codes and trailing zeros. */
+	template <typename Callback>
+	static void forEachNalUnit(const uint8_t * aData, size_t aSize, Callback && aCallback)
+	{
+		size_t nalStart = 0;
+		bool hasNal = false;
+		size_t i = 0;
+		while (i + 2 < aSize)
+		{
+			if ((aData[i] == 0) && (aData[i + 1] == 0) && (aData[i + 2] == 1))
+			{
+				if (hasNal)
+				{
+					emitNalUnit(aData + nalStart, i - nalStart, aCallback);
+				}
+				nalStart = i + 3;
+				hasNal = true;
+				i += 3;
+				continue;
+			}
+			i += 1;
+		}
+		if (hasNal)
+		{
+			emitNalUnit(aData + nalStart, aSize - nalStart, aCallback);
+		}
+	}
+
+
+	template <typename Callback>
+	static void emitNalUnit(const uint8_t * aData, size_t aSize, Callback && aCallback)
+	{
+		while ((aSize > 0) && (aData[aSize - 1] == 0))
+		{
+			aSize -= 1;
+		}
 		if (aSize > 0)
 		{
-			asio::write(aLocalSocket, asio::const_buffer(aData, aSize));
+			aCallback(aData, aSize);
+		}
+	}
+
+
+	/** Returns the NAL unit type. */
+	uint8_t nalType(const uint8_t * aNal) const
+	{
+		return mIsHevc ? ((aNal[0] >> 1) & 0x3f) : (aNal[0] & 0x1f);
+	}
+
+
+	/** Returns true if the NAL unit is a parameter set or an access unit delimiter, which don't go into the samples. */
+	bool isNonSampleNal(const uint8_t * aNal) const
+	{
+		auto type = nalType(aNal);
+		return mIsHevc ? ((type >= 32) && (type <= 35)) : ((type >= 7) && (type <= 9));
+	}
+
+
+	/** Converts the Annex-B frame into mSample, as 4-byte length-prefixed NAL units. */
+	void buildSample(const uint8_t * aData, size_t aSize)
+	{
+		mSample.clear();
+		forEachNalUnit(aData, aSize,
+			[this](const uint8_t * aNal, size_t aNalSize)
+			{
+				if (isNonSampleNal(aNal))
+				{
+					return;
+				}
+				auto size32 = static_cast<uint32_t>(aNalSize);
+				mSample.push_back(static_cast<uint8_t>(size32 >> 24));
+				mSample.push_back(static_cast<uint8_t>(size32 >> 16));
+				mSample.push_back(static_cast<uint8_t>(size32 >> 8));
+				mSample.push_back(static_cast<uint8_t>(size32));
+				mSample.insert(mSample.end(), aNal, aNal + aNalSize);
+			}
+		);
+	}
+
+
+	void put8(uint32_t aValue)
+	{
+		mOut.push_back(static_cast<uint8_t>(aValue));
+	}
+
+	void put16(uint32_t aValue)
+	{
+		put8(aValue >> 8);
+		put8(aValue);
+	}
+
+	void put32(uint32_t aValue)
+	{
+		put16(aValue >> 16);
+		put16(aValue);
+	}
+
+	void put64(uint64_t aValue)
+	{
+		put32(static_cast<uint32_t>(aValue >> 32));
+		put32(static_cast<uint32_t>(aValue));
+	}
+
+	void putBytes(const void * aData, size_t aSize)
+	{
+		auto data = static_cast<const uint8_t *>(aData);
+		mOut.insert(mOut.end(), data, data + aSize);
+	}
+
+	void putZeros(size_t aCount)
+	{
+		mOut.insert(mOut.end(), aCount, 0);
+	}
+
+
+	/** Starts a box of the specified type, returns its position for endBox(). */
+	size_t beginBox(const char * aType)
+	{
+		auto pos = mOut.size();
+		put32(0);
+		putBytes(aType, 4);
+		return pos;
+	}
+
+
+	/** Starts a full box (with version and flags), returns its position for endBox(). */
+	size_t beginFullBox(const char * aType, uint8_t aVersion, uint32_t aFlags)
+	{
+		auto pos = beginBox(aType);
+		put32((static_cast<uint32_t>(aVersion) << 24) | aFlags);
+		return pos;
+	}
+
+
+	/** Finishes the box started at the specified position, by writing its size. */
+	void endBox(size_t aPos)
+	{
+		auto size = static_cast<uint32_t>(mOut.size() - aPos);
+		mOut[aPos]     = static_cast<uint8_t>(size >> 24);
+		mOut[aPos + 1] = static_cast<uint8_t>(size >> 16);
+		mOut[aPos + 2] = static_cast<uint8_t>(size >> 8);
+		mOut[aPos + 3] = static_cast<uint8_t>(size);
+	}
+
+
+	/** Writes the unity transformation matrix used by mvhd and tkhd. */
+	void putMatrix()
+	{
+		static const uint32_t matrix[9] = {0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000};
+		for (auto v: matrix)
+		{
+			put32(v);
+		}
+	}
+
+
+	/** Decodes the H.264 SPS (including its NAL header). */
+	SpsInfo parseAvcSps(const uint8_t * aNal, size_t aSize)
+	{
+		SpsInfo res;
+		RbspReader r(aNal + 1, aSize - 1, mRbsp);
+		auto profile = r.bits(8);
+		r.skip(16);  // Constraint flags, level
+		r.ue();      // seq_parameter_set_id
+		if (
+			(profile == 100) || (profile == 110) || (profile == 122) || (profile == 244) || (profile == 44) ||
+			(profile == 83) || (profile == 86) || (profile == 118) || (profile == 128) || (profile == 138) ||
+			(profile == 139) || (profile == 134) || (profile == 135)
+		)
+		{
+			res.mChromaFormat = r.ue();
+			if (res.mChromaFormat == 3)
+			{
+				r.skip(1);  // separate_colour_plane_flag
+			}
+			res.mBitDepthLumaMinus8 = r.ue();
+			res.mBitDepthChromaMinus8 = r.ue();
+			r.skip(1);  // qpprime_y_zero_transform_bypass_flag
+			if (r.bits(1))  // seq_scaling_matrix_present_flag
+			{
+				for (int i = 0; i < ((res.mChromaFormat != 3) ? 8 : 12); ++i)
+				{
+					if (!r.bits(1))
+					{
+						continue;
+					}
+					int lastScale = 8, nextScale = 8;
+					for (int j = 0; j < ((i < 6) ? 16 : 64); ++j)
+					{
+						if (nextScale != 0)
+						{
+							nextScale = (lastScale + r.se() + 256) % 256;
+						}
+						lastScale = (nextScale == 0) ? lastScale : nextScale;
+					}
+				}
+			}
+		}
+		r.ue();  // log2_max_frame_num_minus4
+		auto pocType = r.ue();
+		if (pocType == 0)
+		{
+			r.ue();  // log2_max_pic_order_cnt_lsb_minus4
+		}
+		else if (pocType == 1)
+		{
+			r.skip(1);  // delta_pic_order_always_zero_flag
+			r.se();
+			r.se();
+			auto numRefFramesInCycle = r.ue();
+			for (uint32_t i = 0; (i < numRefFramesInCycle) && (i < 256); ++i)
+			{
+				r.se();
+			}
+		}
+		r.ue();     // max_num_ref_frames
+		r.skip(1);  // gaps_in_frame_num_value_allowed_flag
+		auto widthInMbs = r.ue() + 1;
+		auto heightInMapUnits = r.ue() + 1;
+		auto frameMbsOnly = r.bits(1);
+		if (!frameMbsOnly)
+		{
+			r.skip(1);  // mb_adaptive_frame_field_flag
+		}
+		r.skip(1);  // direct_8x8_inference_flag
+		uint32_t cropLeft = 0, cropRight = 0, cropTop = 0, cropBottom = 0;
+		if (r.bits(1))
+		{
+			cropLeft = r.ue();
+			cropRight = r.ue();
+			cropTop = r.ue();
+			cropBottom = r.ue();
+		}
+		uint32_t cropUnitX = ((res.mChromaFormat == 1) || (res.mChromaFormat == 2)) ? 2 : 1;
+		uint32_t cropUnitY = ((res.mChromaFormat == 1) ? 2 : 1) * (2 - frameMbsOnly);
+		res.mWidth = widthInMbs * 16 - cropUnitX * (cropLeft + cropRight);
+		res.mHeight = (2 - frameMbsOnly) * heightInMapUnits * 16 - cropUnitY * (cropTop + cropBottom);
+		return res;
+	}
+
+
+	/** Decodes the H.265 SPS (including its NAL header). */
+	SpsInfo parseHevcSps(const uint8_t * aNal, size_t aSize)
+	{
+		SpsInfo res;
+		RbspReader r(aNal + 2, aSize - 2, mRbsp);
+		r.skip(4);  // sps_video_parameter_set_id
+		res.mMaxSubLayersMinus1 = r.bits(3);
+		res.mTemporalIdNesting = r.bits(1);
+		for (auto & b: res.mProfileTierLevel)
+		{
+			b = static_cast<uint8_t>(r.bits(8));
+		}
+		bool subLayerProfilePresent[8] = {}, subLayerLevelPresent[8] = {};
+		for (uint32_t i = 0; i < res.mMaxSubLayersMinus1; ++i)
+		{
+			subLayerProfilePresent[i] = (r.bits(1) != 0);
+			subLayerLevelPresent[i] = (r.bits(1) != 0);
+		}
+		if (res.mMaxSubLayersMinus1 > 0)
+		{
+			r.skip(2 * (8 - res.mMaxSubLayersMinus1));
+		}
+		for (uint32_t i = 0; i < res.mMaxSubLayersMinus1; ++i)
+		{
+			r.skip((subLayerProfilePresent[i] ? 88 : 0) + (subLayerLevelPresent[i] ? 8 : 0));
+		}
+		r.ue();  // sps_seq_parameter_set_id
+		res.mChromaFormat = r.ue();
+		if (res.mChromaFormat == 3)
+		{
+			r.skip(1);  // separate_colour_plane_flag
+		}
+		res.mWidth = r.ue();
+		res.mHeight = r.ue();
+		if (r.bits(1))  // conformance_window_flag
+		{
+			auto left = r.ue(), right = r.ue(), top = r.ue(), bottom = r.ue();
+			uint32_t subWidth = ((res.mChromaFormat == 1) || (res.mChromaFormat == 2)) ? 2 : 1;
+			uint32_t subHeight = (res.mChromaFormat == 1) ? 2 : 1;
+			res.mWidth -= subWidth * (left + right);
+			res.mHeight -= subHeight * (top + bottom);
+		}
+		res.mBitDepthLumaMinus8 = r.ue();
+		res.mBitDepthChromaMinus8 = r.ue();
+		return res;
+	}
+
+
+	/** Writes the ftyp and moov boxes, describing the stream by the parameter sets in the I-frame.
+	Returns false if the I-frame doesn't contain all the needed parameter sets. */
+	bool writeInitSegment(const uint8_t * aData, size_t aSize)
+	{
+		// The codec is told by the first NAL unit, H.265 I-frames start with a VPS (40 01):
+		const uint8_t * firstNal = nullptr;
+		forEachNalUnit(aData, aSize,
+			[&firstNal](const uint8_t * aNal, size_t)
+			{
+				if (firstNal == nullptr)
+				{
+					firstNal = aNal;
+				}
+			}
+		);
+		if (firstNal == nullptr)
+		{
+			return false;
+		}
+		mIsHevc = ((firstNal[0] == 0x40) && (firstNal + 1 < aData + aSize) && (firstNal[1] == 0x01));
+
+		// Collect the parameter sets, the first one of each kind:
+		std::pair<const uint8_t *, size_t> vps{nullptr, 0}, sps{nullptr, 0}, pps{nullptr, 0};
+		forEachNalUnit(aData, aSize,
+			[&](const uint8_t * aNal, size_t aNalSize)
+			{
+				auto minSize = static_cast<size_t>(mIsHevc ? 3 : 2);
+				if (aNalSize < minSize)
+				{
+					return;
+				}
+				auto type = nalType(aNal);
+				auto & ps = mIsHevc ?
+					((type == 32) ? vps : ((type == 33) ? sps : pps)) :
+					((type == 7) ? sps : pps);
+				bool isPs = mIsHevc ? ((type >= 32) && (type <= 34)) : ((type == 7) || (type == 8));
+				if (isPs && (ps.first == nullptr))
+				{
+					ps = {aNal, aNalSize};
+				}
+			}
+		);
+		if ((sps.first == nullptr) || (pps.first == nullptr) || (mIsHevc && (vps.first == nullptr)))
+		{
+			return false;
+		}
+		auto info = mIsHevc ? parseHevcSps(sps.first, sps.second) : parseAvcSps(sps.first, sps.second);
+
+		// ftyp:
+		auto ftyp = beginBox("ftyp");
+		putBytes("isom", 4);
+		put32(0x200);
+		putBytes("isomiso6mp41", 12);
+		endBox(ftyp);
+
+		auto moov = beginBox("moov");
+		{
+			auto mvhd = beginFullBox("mvhd", 0, 0);
+			put32(0);           // Creation time
+			put32(0);           // Modification time
+			put32(1000);        // Timescale
+			put32(0);           // Duration, unknown
+			put32(0x00010000);  // Rate 1.0
+			put16(0x0100);      // Volume 1.0
+			putZeros(10);
+			putMatrix();
+			putZeros(24);
+			put32(2);           // Next track ID
+			endBox(mvhd);
+
+			auto trak = beginBox("trak");
+			{
+				auto tkhd = beginFullBox("tkhd", 0, 3);  // Enabled, in movie
+				put32(0);  // Creation time
+				put32(0);  // Modification time
+				put32(1);  // Track ID
+				put32(0);
+				put32(0);  // Duration, unknown
+				putZeros(8);
+				put16(0);  // Layer
+				put16(0);  // Alternate group
+				put16(0);  // Volume
+				put16(0);
+				putMatrix();
+				put32(info.mWidth << 16);
+				put32(info.mHeight << 16);
+				endBox(tkhd);
+
+				auto mdia = beginBox("mdia");
+				{
+					auto mdhd = beginFullBox("mdhd", 0, 0);
+					put32(0);  // Creation time
+					put32(0);  // Modification time
+					put32(cTimeScale);
+					put32(0);       // Duration, unknown
+					put16(0x55c4);  // Language "und"
+					put16(0);
+					endBox(mdhd);
+
+					auto hdlr = beginFullBox("hdlr", 0, 0);
+					put32(0);
+					putBytes("vide", 4);
+					putZeros(12);
+					putBytes("VideoHandler", 13);
+					endBox(hdlr);
+
+					auto minf = beginBox("minf");
+					{
+						auto vmhd = beginFullBox("vmhd", 0, 1);
+						putZeros(8);  // Graphics mode, opcolor
+						endBox(vmhd);
+
+						auto dinf = beginBox("dinf");
+						auto dref = beginFullBox("dref", 0, 0);
+						put32(1);
+						auto url = beginFullBox("url ", 0, 1);  // The data is in this file
+						endBox(url);
+						endBox(dref);
+						endBox(dinf);
+
+						auto stbl = beginBox("stbl");
+						writeStsd(info, vps, sps, pps);
+						for (auto type: {"stts", "stsc", "stco"})
+						{
+							auto box = beginFullBox(type, 0, 0);
+							put32(0);  // No entries, the samples are in the fragments
+							endBox(box);
+						}
+						auto stsz = beginFullBox("stsz", 0, 0);
+						put32(0);  // Sample size
+						put32(0);  // Sample count
+						endBox(stsz);
+						endBox(stbl);
+					}
+					endBox(minf);
+				}
+				endBox(mdia);
+			}
+			endBox(trak);
+
+			auto mvex = beginBox("mvex");
+			auto trex = beginFullBox("trex", 0, 0);
+			put32(1);  // Track ID
+			put32(1);  // Default sample description index
+			put32(0);  // Default sample duration
+			put32(0);  // Default sample size
+			put32(0);  // Default sample flags
+			endBox(trex);
+			endBox(mvex);
+		}
+		endBox(moov);
+		return true;
+	}
+
+
+	/** Writes the stsd box with the single avc1 / hvc1 sample entry. */
+	void writeStsd(
+		const SpsInfo & aInfo,
+		std::pair<const uint8_t *, size_t> aVps,
+		std::pair<const uint8_t *, size_t> aSps,
+		std::pair<const uint8_t *, size_t> aPps
+	)
+	{
+		auto stsd = beginFullBox("stsd", 0, 0);
+		put32(1);  // Entry count
+		auto entry = beginBox(mIsHevc ? "hvc1" : "avc1");
+		putZeros(6);
+		put16(1);  // Data reference index
+		putZeros(16);
+		put16(aInfo.mWidth);
+		put16(aInfo.mHeight);
+		put32(0x00480000);  // 72 dpi
+		put32(0x00480000);
+		put32(0);
+		put16(1);  // Frame count
+		putZeros(32);  // Compressor name
+		put16(0x0018);  // Depth
+		put16(0xffff);
+		if (mIsHevc)
+		{
+			auto hvcc = beginBox("hvcC");
+			put8(1);  // Configuration version
+			putBytes(aInfo.mProfileTierLevel, sizeof(aInfo.mProfileTierLevel));
+			put16(0xf000);  // Min spatial segmentation
+			put8(0xfc);     // Parallelism type unknown
+			put8(0xfc | aInfo.mChromaFormat);
+			put8(0xf8 | aInfo.mBitDepthLumaMinus8);
+			put8(0xf8 | aInfo.mBitDepthChromaMinus8);
+			put16(0);  // Average frame rate, unknown
+			put8(((aInfo.mMaxSubLayersMinus1 + 1) << 3) | (aInfo.mTemporalIdNesting << 2) | 3);  // 4-byte NAL lengths
+			put8(3);  // Number of arrays
+			uint8_t types[] = {32, 33, 34};
+			std::pair<const uint8_t *, size_t> nals[] = {aVps, aSps, aPps};
+			for (size_t i = 0; i < 3; ++i)
+			{
+				put8(0x80 | types[i]);  // Array completeness
+				put16(1);
+				put16(static_cast<uint32_t>(nals[i].second));
+				putBytes(nals[i].first, nals[i].second);
+			}
+			endBox(hvcc);
+		}
+		else
+		{
+			auto avcc = beginBox("avcC");
+			put8(1);  // Configuration version
+			putBytes(aSps.first + 1, 3);  // Profile, compatibility, level
+			put8(0xff);  // 4-byte NAL lengths
+			put8(0xe1);  // One SPS
+			put16(static_cast<uint32_t>(aSps.second));
+			putBytes(aSps.first, aSps.second);
+			put8(1);  // One PPS
+			put16(static_cast<uint32_t>(aPps.second));
+			putBytes(aPps.first, aPps.second);
+			auto profile = aSps.first[1];
+			if ((profile == 100) || (profile == 110) || (profile == 122) || (profile == 144))
+			{
+				put8(0xfc | aInfo.mChromaFormat);
+				put8(0xf8 | aInfo.mBitDepthLumaMinus8);
+				put8(0xf8 | aInfo.mBitDepthChromaMinus8);
+				put8(0);  // No SPS extensions
+			}
+			endBox(avcc);
 		}
+		endBox(entry);
+		endBox(stsd);
+	}
+
+
+	/** Writes the moof and mdat boxes for the frame in mSample, with the specified decode time. */
+	void writeFragment(bool aIsIFrame, uint64_t aDecodeTime)
+	{
+		mSequenceNumber += 1;
+		auto moof = beginBox("moof");
+		auto mfhd = beginFullBox("mfhd", 0, 0);
+		put32(mSequenceNumber);
+		endBox(mfhd);
+		auto traf = beginBox("traf");
+		auto tfhd = beginFullBox("tfhd", 0, 0x020000);  // Default base is moof
+		put32(1);  // Track ID
+		endBox(tfhd);
+		auto tfdt = beginFullBox("tfdt", 1, 0);
+		put64(aDecodeTime);
+		endBox(tfdt);
+		auto trun = beginFullBox("trun", 0, 0x000701);  // Data offset, sample duration, size and flags
+		put32(1);  // Sample count
+		auto dataOffsetPos = mOut.size();
+		put32(0);  // Data offset, filled in below
+		put32(static_cast<uint32_t>(mLastDuration));
+		put32(static_cast<uint32_t>(mSample.size()));
+		put32(aIsIFrame ? 0x02000000 : 0x01010000);  // Sync sample / depends on others, non-sync
+		endBox(trun);
+		endBox(traf);
+		endBox(moof);
+
+		// The data offset is relative to the moof start, the sample follows the mdat header:
+		auto dataOffset = static_cast<uint32_t>(mOut.size() - moof + 8);
+		mOut[dataOffsetPos]     = static_cast<uint8_t>(dataOffset >> 24);
+		mOut[dataOffsetPos + 1] = static_cast<uint8_t>(dataOffset >> 16);
+		mOut[dataOffsetPos + 2] = static_cast<uint8_t>(dataOffset >> 8);
+		mOut[dataOffsetPos + 3] = static_cast<uint8_t>(dataOffset);
+
+		auto mdat = beginBox("mdat");
+		putBytes(mSample.data(), mSample.size());
+		endBox(mdat);
+	}
+};
+
+
+
+
+
+/** Writes the data to the local client; when serving over HTTP, wraps the data in a single HTTP chunk. */
+static void writeToClient(asio::ip::tcp::socket & aLocalSocket, const std::array<asio::const_buffer, 2> & aBuffers)
+{
+	if (!isHttpOutput())
+	{
+		asio::write(aLocalSocket, aBuffers);
+		return;
+	}
+	char chunkHeader[24];
+	auto chunkHeaderLen = snprintf(chunkHeader, sizeof(chunkHeader), "%zx\r\n", aBuffers[0].size() + aBuffers[1].size());
+	std::array<asio::const_buffer, 4> chunk =
+	{
+		asio::const_buffer(chunkHeader, static_cast<size_t>(chunkHeaderLen)),
+		aBuffers[0],
+		aBuffers[1],
+		asio::const_buffer("\r\n", 2)
 	};
+	asio::write(aLocalSocket, chunk);
+}
+
+
+
+
+
+void relayOnSocket(asio::ip::tcp::socket & aLocalSocket)
+{
+	std::cout << "Client connected: " << aLocalSocket.remote_endpoint() << std::endl;
+
+	// When serving over HTTP, read the request (whatever it is) and send the response headers:
+	if (isHttpOutput())
+	{
+		try
+		{
+			std::string request;
+			asio::read_until(aLocalSocket, asio::dynamic_buffer(request), "\r\n\r\n");
+			auto response = fmt::format(
+				"HTTP/1.1 200 OK\r\n"
+				"Content-Type: {}\r\n"
+				"Transfer-Encoding: chunked\r\n"
+				"Cache-Control: no-cache\r\n"
+				"Connection: close\r\n"
+				"\r\n",
+				(gOutputFormat == OutputFormat::HttpFmp4) ? "video/mp4" : "video/mp2t"
+			);
+			asio::write(aLocalSocket, asio::buffer(response));
+		}
+		catch (const std::exception & exc)
+		{
+			std::cerr << "Failed to process the HTTP request: " << exc.what() << std::endl;
+			return;
+		}
+	}
 
+	// Any thread can end the relay by calling signalFinished():
 	std::mutex mtxFinished;
 	std::condition_variable cvFinished;
-	NetSurveillancePp::CapturedStreamParser csp(onVideoFrame, onVideoFrame);
+	bool isFinished = false;
+	auto signalFinished = [&]()
+	{
+		std::unique_lock<std::mutex> lg(mtxFinished);
+		isFinished = true;
+		cvFinished.notify_all();
+	};
+
+	// The NVR callbacks run on the library's network thread, which cannot be joined. They touch this function's
+	// locals only while holding the gate's lock, and only until the relay is stopped. The gate is shared with
+	// the callbacks, so that it outlives this function:
+	struct RelayGate
+	{
+		std::mutex mMtx;
+		bool mIsStopped = false;
+	};
+	auto gate = std::make_shared<RelayGate>();
+
+	// In the queued mode, the network thread only pushes the frames into the ring and the writer thread
+	// sends them to the local socket. When the ring overflows, frames are dropped until the next I-frame,
+	// so that the client's decoder never sees a P-frame without its reference:
+	std::unique_ptr<SpscFrameRing> ring;
+	std::thread writerThread;
+	std::atomic<bool> shouldStopWriter(false);
+	std::mutex mtxRingData;
+	std::condition_variable cvRingData;
+	bool isSkippingToIFrame = false;
+	bool isOverCapacity = false;
+	size_t numDroppedFrames = 0;
+	if (gQueueSize > 0)
+	{
+		ring.reset(new SpscFrameRing(gQueueSize));
+		writerThread = std::thread([&]()
+			{
+				try
+				{
+					while (!shouldStopWriter.load())
+					{
+						auto hasWritten = ring->consume(
+							[&aLocalSocket](const std::array<asio::const_buffer, 2> & aBuffers)
+							{
+								writeToClient(aLocalSocket, aBuffers);
+							}
+						);
+						if (!hasWritten)
+						{
+							std::unique_lock<std::mutex> lg(mtxRingData);
+							cvRingData.wait_for(lg, std::chrono::milliseconds(10));
+						}
+					}
+				}
+				catch (const std::exception & exc)
+				{
+					std::cerr << "Writing to the local client failed: " << exc.what() << std::endl;
+					signalFinished();
+				}
+			}
+		);
+	}
+	auto queueFrame = [&](const void * aData, size_t aSize, bool aIsIFrame)
+	{
+		if (isOverCapacity)
+		{
+			return;
+		}
+		if (aSize > ring->maxFrameSize())
+		{
+			// The frame would never fit, skipping to the next I-frame could drop everything from now on:
+			std::cerr << fmt::format("A frame of {} bytes doesn't fit into the queue of {} bytes, disconnecting the client.\n",
+				aSize, gQueueSize
+			);
+			isOverCapacity = true;
+			signalFinished();
+			return;
+		}
+		if (aIsIFrame)
+		{
+			isSkippingToIFrame = false;
+		}
+		if (isSkippingToIFrame || !ring->push(aData, aSize))
+		{
+			isSkippingToIFrame = true;
+			numDroppedFrames += 1;
+			return;
+		}
+		cvRingData.notify_one();
+	};
+
+	// Each frame is optionally muxed into TS or fMP4, then either written directly or queued:
+	bool isFmp4 = (gOutputFormat == OutputFormat::Fmp4) || (gOutputFormat == OutputFormat::HttpFmp4);
+	TsMuxer tsMuxer;
+	Fmp4Muxer fmp4Muxer;
+	auto streamStart = std::chrono::steady_clock::now();
+	// The stats are only collected when they are printed, otherwise they cost nothing:
+	std::unique_ptr<StreamStats> stats;
+	if (gStatsInterval > 0)
+	{
+		stats.reset(new StreamStats);
+	}
+	auto onVideoFrame = [&](const void * aData, size_t aSize, bool aIsIFrame)
+	{
+		if (stats != nullptr)
+		{
+			stats->onFrame(aSize, aIsIFrame);
+		}
+		if ((aSize == 0) || (gKeyFramesOnly && !aIsIFrame))
+		{
+			return;
+		}
+		if (gOutputFormat != OutputFormat::ElementaryStream)
+		{
+			// The CapturedStreamParser doesn't report the frame timestamps, use the arrival time instead:
+			auto elapsed = std::chrono::steady_clock::now() - streamStart;
+			auto timeStamp90k = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count()) * 9 / 100;
+			const auto & muxed = isFmp4 ?
+				fmp4Muxer.mux(aData, aSize, aIsIFrame, timeStamp90k) :
+				tsMuxer.mux(aData, aSize, aIsIFrame, timeStamp90k);
+			if (muxed.empty())
+			{
+				return;
+			}
+			aData = muxed.data();
+			aSize = muxed.size();
+		}
+		if (ring == nullptr)
+		{
+			writeToClient(aLocalSocket, {asio::const_buffer(aData, aSize), asio::const_buffer()});
+		}
+		else
+		{
+			queueFrame(aData, aSize, aIsIFrame);
+		}
+	};
+	auto onVideoIFrame = [&](const void * aData, size_t aSize)
+	{
+		onVideoFrame(aData, aSize, true);
+	};
+	auto onVideoPFrame = [&](const void * aData, size_t aSize)
+	{
+		onVideoFrame(aData, aSize, false);
+	};
+
+	NetSurveillancePp::CapturedStreamParser csp(onVideoIFrame, onVideoPFrame);
 	auto rec = Recorder::create();
 	Recorder::ICapturedStreamReceiverPtr csr;
 	rec->connectAndLogin(gNvrHostName, gNvrPort, gNvrUserName, gNvrPassword,
-		[&](const std::error_code & aError)
+		[&, gate](const std::error_code & aError)
 		{
+			std::unique_lock<std::mutex> lgGate(gate->mMtx);
+			if (gate->mIsStopped)
+			{
+				return;
+			}
 			if (aError)
 			{
 				std::cerr << "Error while connecting to NVR: " << aError.message() << std::endl;
-				std::unique_lock<std::mutex> lg(mtxFinished);
-				cvFinished.notify_all();
+				signalFinished();
 				return;
 			}
 			std::cout << "Connected and logged into NVR. Requesting video data" << std::endl;
 			csr = rec->receiveLiveVideo(
-				[&](const std::error_code & aError, const void * aData, size_t aSize)
+				[&, gate](const std::error_code & aError, const void * aData, size_t aSize)
 				{
+					std::unique_lock<std::mutex> lgGate(gate->mMtx);
+					if (gate->mIsStopped)
+					{
+						return;
+					}
 					if (aError)
 					{
 						std::cerr << "Error while receiving CapturedStream data: " << aError.message() << std::endl;
-						std::unique_lock<std::mutex> lg(mtxFinished);
-						cvFinished.notify_all();
+						signalFinished();
 						return;
 					}
+					if (stats != nullptr)
+					{
+						stats->onPacket(aSize);
+					}
 					try
 					{
 						csp.parse(aData, aSize);
 					}
 					catch (const std::exception & exc)
 					{
+						// The receiver gets closed once the relay is stopped, outside of the gate's lock:
 						std::cerr << " Parsing CapturedStream failed: " << exc.what() << std::endl;
-						auto csrCapture = csr;
-						if (csrCapture != nullptr)
-						{
-							std::cerr << "Closing CapturedStreamReceiver." << std::endl;
-							csrCapture->close();
-						}
-						std::unique_lock<std::mutex> lg(mtxFinished);
-						cvFinished.notify_all();
+						signalFinished();
 						return;
 					}
 				},
@@ -94,10 +1525,53 @@ void relayOnSocket(asio::ip::tcp::socket & aLocalSocket)
 		}
 	);
 
-	// Wait for completion:
+	// Wait for completion, printing the stream statistics periodically, if requested:
 	{
 		std::unique_lock<std::mutex> lg(mtxFinished);
-		cvFinished.wait(lg);
+		if (stats == nullptr)
+		{
+			cvFinished.wait(lg, [&]() { return isFinished; });
+		}
+		else
+		{
+			auto prev = stats->sample();
+			while (!cvFinished.wait_for(lg, std::chrono::seconds(gStatsInterval), [&]() { return isFinished; }))
+			{
+				auto cur = stats->sample();
+				auto sec = std::chrono::duration<double>(cur.mTime - prev.mTime).count();
+				std::cout << fmt::format(
+					"Stream stats: {:.0f} kbit/s, {:.1f} fps, GOP {} frames, last I-frame {} bytes, jitter {} usec, {} I-frames total\n",
+					static_cast<double>(cur.mNumBytes - prev.mNumBytes) * 8 / 1000 / sec,
+					static_cast<double>(cur.mNumFrames - prev.mNumFrames) / sec,
+					cur.mLastGopLength,
+					cur.mLastIFrameSize,
+					cur.mJitterUsec,
+					cur.mNumIFrames
+				);
+				prev = cur;
+			}
+		}
+	}
+
+	// Stop the relay, so that the network thread doesn't touch the ring nor the counters anymore:
+	Recorder::ICapturedStreamReceiverPtr csrCapture;
+	{
+		std::unique_lock<std::mutex> lgGate(gate->mMtx);
+		gate->mIsStopped = true;
+		csrCapture = csr;
+	}
+	if (csrCapture != nullptr)
+	{
+		csrCapture->close();
+	}
+
+	// Stop the writer thread, if any:
+	if (writerThread.joinable())
+	{
+		shouldStopWriter = true;
+		cvRingData.notify_one();
+		writerThread.join();
+		std::cout << "Frames dropped due to a full queue: " << numDroppedFrames << std::endl;
 	}
 }
 
@@ -106,7 +1580,19 @@ void relayOnSocket(asio::ip::tcp::socket & aLocalSocket)
 
 
 /** The commandline params indicate the NVR to use, the credentials and the channel number;
-lastly, the local TCP port on which to listen (34570 + channel by default). */
+then the local TCP port on which to listen (34570 + channel by default);
+then the size of the frame queue in KiB (0 by default, otherwise at least cMinQueueSizeKiB). If the queue
+size is non-zero, the video frames are queued by the network thread and written to the local client by a
+separate thread, so that a slow client doesn't hold up the network thread; frames are dropped (up to the next
+I-frame) when the queue is full; a frame larger than the whole queue disconnects the client;
+then "keyframes" to relay only the I-frames to the client ("all" frames are relayed by default);
+then the output format: "es" for the raw video elementary stream (default), "ts" for MPEG-TS,
+"http" for MPEG-TS served over HTTP (playable by e.g. "ffplay http://localhost:<port>/" or VLC; browsers
+don't play MPEG-TS natively), "mp4" for fragmented MP4 or "http-mp4" for fragmented MP4 served over HTTP
+(playable by a browser's <video> element, as long as the browser supports the codec - H.265 isn't
+supported everywhere);
+lastly, the interval in seconds for printing the stream statistics (bitrate, fps, GOP length, I-frame size,
+packet jitter), 0 (default) disables the printing. */
 int main(int aArgC, char * aArgV[])
 {
 	gNvrHostName    = (aArgC < 2) ? "localhost" : aArgV[1];
@@ -121,6 +1607,36 @@ int main(int aArgC, char * aArgV[])
 		gNvrPort = 34567;
 	}
 	auto localPort = (aArgC < 7) ? (34570 + gNvrChannel) : std::atoi(aArgV[6]);
+	auto queueSizeKiB = (aArgC < 8) ? 0 : static_cast<size_t>(std::atoi(aArgV[7]));
+	if ((queueSizeKiB > 0) && (queueSizeKiB < cMinQueueSizeKiB))
+	{
+		std::cerr << "The queue size needs to be either 0 or at least " << cMinQueueSizeKiB << " KiB\n";
+		return 1;
+	}
+	gQueueSize      = queueSizeKiB * 1024;
+	gKeyFramesOnly  = (aArgC >= 9) && (std::string(aArgV[8]) == "keyframes");
+	std::string outputFormat = (aArgC < 10) ? "es" : aArgV[9];
+	gStatsInterval  = (aArgC < 11) ? 0 : std::atoi(aArgV[10]);
+	if (outputFormat == "ts")
+	{
+		gOutputFormat = OutputFormat::MpegTs;
+	}
+	else if (outputFormat == "http")
+	{
+		gOutputFormat = OutputFormat::HttpMpegTs;
+	}
+	else if (outputFormat == "mp4")
+	{
+		gOutputFormat = OutputFormat::Fmp4;
+	}
+	else if (outputFormat == "http-mp4")
+	{
+		gOutputFormat = OutputFormat::HttpFmp4;
+	}
+	else if (outputFormat != "es")
+	{
+		std::cerr << "Unknown output format " << outputFormat << ", using the raw elementary stream instead\n";
+	}
 	std::cout << "Will connect to " << gNvrHostName << " : " << gNvrPort << " using credentials " << gNvrUserName << " / " << gNvrPassword << "..." << std::endl;
 
 	try
@@ -0,0 +1,263 @@
+-- ConfigRollout.lua
+
+--[[
+Rolls out configuration changes to a whole fleet of devices.
+For each device, reads the current values of the changed configs, merges the requested changes into them
+and sets only those configs that actually differ. The devices are processed in parallel, up to a limit,
+by a single thread: each device is handled by its own coroutine over a cooperative Nvr connection (see
+Nvr.connectCooperative()). The requests on each connection are pipelined (all gets, then all sets).
+A result line is printed for each device as soon as it finishes, followed by a summary at the end.
+
+Usage:
+	lua ConfigRollout.lua <FleetFile> <ChangesFile> [<MaxParallel>] [--dry-run]
+
+The FleetFile lists the devices, one per line: "<host> <port> <username> <passwordHash>"; empty lines and
+lines starting with a '#' are ignored. Use 00-SofiaHash to get the password hash.
+The ChangesFile is a Lua file returning a table of ConfigName -> changes; the changes are a partial config
+value, only the listed members are changed. For example, enabling the motion detection on the first two
+channels and setting the auto logout:
+	return
+	{
+		["Detect.MotionDetect"] = { { Enable = true }, { Enable = true } },
+		["General.General"] = { AutoLogout = 10 },
+	}
+MaxParallel is the maximum number of devices processed at the same time, 32 by default.
+With --dry-run, the differences are reported but nothing is set.
+--]]
+
+
+
+
+local nvr = require("Nvr")
+local socket = require("socket")
+
+
+
+
+--- The maximum number of seconds a single device may take, including the connecting:
+local gDeviceTimeout = 30
+
+
+
+
+
+--- Reads the fleet file
+-- Returns an array-table of {hostName, port, username, passwordHash} on success, nil and message on failure
+local function readFleetFile(aFileName)
+	local f, msg = io.open(aFileName, "r")
+	if not(f) then
+		return nil, msg
+	end
+	local res = {}
+	local lineNum = 0
+	for line in f:lines() do
+		lineNum = lineNum + 1
+		if ((line ~= "") and (string.sub(line, 1, 1) ~= "#")) then
+			local hostName, port, username, passwordHash = string.match(line, "^%s*(%S+)%s+(%d+)%s+(%S+)%s+(%S+)%s*$")
+			if not(hostName) then
+				f:close()
+				return nil, "Cannot parse line " .. lineNum .. ": " .. line
+			end
+			res[#res + 1] = {hostName = hostName, port = tonumber(port), username = username, passwordHash = passwordHash}
+		end
+	end
+	f:close()
+	return res
+end
+
+
+
+
+
+--- Returns the current value with the changes applied over it (recursively), and true if the result differs
+-- from the current value
+-- Tables that the changes don't touch are returned as-is; a changed table is copied together with its metatable,
+-- so that the JSON arrays (including the empty ones) decoded by dkjson are still encoded as arrays.
+local function mergeChanges(aCurrent, aChanges)
+	if ((type(aChanges) ~= "table") or (type(aCurrent) ~= "table")) then
+		return aChanges, (aCurrent ~= aChanges)
+	end
+	local res = aCurrent
+	for k, v in pairs(aChanges) do
+		local merged, isMemberDifferent = mergeChanges(aCurrent[k], v)
+		if (isMemberDifferent) then
+			if (res == aCurrent) then
+				res = setmetatable({}, getmetatable(aCurrent))
+				for ck, cv in pairs(aCurrent) do
+					res[ck] = cv
+				end
+			end
+			res[k] = merged
+		end
+	end
+	return res, (res ~= aCurrent)
+end
+
+
+
+
+
+--- Processes a single device, to be run as a coroutine
+-- Returns the result line to report
+local function rolloutToDevice(aDevice, aChanges, aConfigNames, aIsDryRun)
+	local conn, msg = nvr.connectCooperative(aDevice.hostName, aDevice.port)
+	if not(conn) then
+		return "FAILED to connect: " .. tostring(msg)
+	end
+	local isSuccess
+	isSuccess, msg = conn:login(aDevice.username, aDevice.passwordHash)
+	if not(isSuccess) then
+		conn.mSocket:close()
+		return "FAILED to log in: " .. tostring(msg)
+	end
+
+	-- Read the current values, all at once:
+	local current
+	current, msg = conn:getConfigs(aConfigNames)
+	if not(current) then
+		conn.mSocket:close()
+		return "FAILED to read the config " .. tostring(msg)
+	end
+
+	-- Compute the new values and set the differing ones, all at once:
+	local toSet = {}
+	local changedNames = {}
+	for _, name in ipairs(aConfigNames) do
+		local newValue, isDifferent = mergeChanges(current[name], aChanges[name])
+		if (isDifferent) then
+			toSet[name] = newValue
+			changedNames[#changedNames + 1] = name
+		end
+	end
+	if not(changedNames[1]) then
+		conn.mSocket:close()
+		return "OK, already up to date"
+	end
+	if (aIsDryRun) then
+		conn.mSocket:close()
+		return "WOULD CHANGE " .. table.concat(changedNames, ", ")
+	end
+	isSuccess, msg = conn:setConfigs(toSet)
+	conn.mSocket:close()
+	if not(isSuccess) then
+		return "FAILED to set the config " .. tostring(msg)
+	end
+	return "OK, changed " .. table.concat(changedNames, ", ")
+end
+
+
+
+
+
+-- Parse the cmdline:
+local args = {...}
+local isDryRun = false
+local positional = {}
+for _, arg in ipairs(args) do
+	if (arg == "--dry-run") then
+		isDryRun = true
+	else
+		positional[#positional + 1] = arg
+	end
+end
+if not(positional[2]) then
+	print("Usage: lua ConfigRollout.lua <FleetFile> <ChangesFile> [<MaxParallel>] [--dry-run]")
+	os.exit(1)
+end
+local devices = assert(readFleetFile(positional[1]))
+local changes = assert(dofile(positional[2]))
+assert(type(changes) == "table", "The changes file needs to return a table of ConfigName -> changes")
+local maxParallel = tonumber(positional[3] or 32)
+assert(maxParallel and (maxParallel >= 1), "MaxParallel needs to be a positive number")
+local configNames = {}
+for name, _ in pairs(changes) do
+	configNames[#configNames + 1] = name
+end
+table.sort(configNames)
+
+-- Run the devices' coroutines, each waiting for its socket:
+print(string.format("Rolling out %d configs to %d devices, %d in parallel%s...",
+	#configNames, #devices, maxParallel, isDryRun and " (dry run)" or ""
+))
+local startTime = socket.gettime()
+local running = {}  -- Array of {device, coroutine, waitFor ("read" / "write"), socket, deadline}
+local nextDevice = 1
+local numOk, numFailed = 0, 0
+
+--- Resumes the device's coroutine; reports the result and returns true if the coroutine has finished
+local function resume(aRun)
+	local isSuccess, waitFor, skt = coroutine.resume(aRun.coroutine)
+	local result
+	if not(isSuccess) then
+		-- The coroutine raised an error, it won't close its socket anymore:
+		if (aRun.socket) then
+			aRun.socket:close()
+		end
+		result = "FAILED: " .. tostring(waitFor)
+	elseif (coroutine.status(aRun.coroutine) == "dead") then
+		result = waitFor
+	else
+		aRun.waitFor, aRun.socket = waitFor, skt
+		return false
+	end
+	if (string.sub(result, 1, 6) == "FAILED") then
+		numFailed = numFailed + 1
+	else
+		numOk = numOk + 1
+	end
+	print(aRun.device.hostName .. ":" .. aRun.device.port .. ": " .. result)
+	io.output():flush()
+	return true
+end
+
+while (running[1] or devices[nextDevice]) do
+	-- Start new devices, up to the limit:
+	while (devices[nextDevice] and (#running < maxParallel)) do
+		local device = devices[nextDevice]
+		nextDevice = nextDevice + 1
+		local run =
+		{
+			device = device,
+			coroutine = coroutine.create(function()
+				return rolloutToDevice(device, changes, configNames, isDryRun)
+			end),
+			deadline = socket.gettime() + gDeviceTimeout,
+		}
+		if not(resume(run)) then
+			running[#running + 1] = run
+		end
+	end
+
+	-- Wait for any socket to become ready:
+	local recvt, sendt = {}, {}
+	for _, run in ipairs(running) do
+		if (run.waitFor == "read") then
+			recvt[#recvt + 1] = run.socket
+		else
+			sendt[#sendt + 1] = run.socket
+		end
+	end
+	local readable, writable = socket.select(recvt, sendt, 1)
+
+	-- Resume the ready ones, drop the finished and timed-out ones:
+	local now = socket.gettime()
+	for idx = #running, 1, -1 do
+		local run = running[idx]
+		-- Check the deadline first, so that a device that keeps trickling data can't run forever:
+		if (now > run.deadline) then
+			run.socket:close()
+			numFailed = numFailed + 1
+			print(run.device.hostName .. ":" .. run.device.port .. ": FAILED: timeout")
+			table.remove(running, idx)
+		elseif (readable[run.socket] or writable[run.socket]) then
+			if (resume(run)) then
+				table.remove(running, idx)
+			end
+		end
+	end
+end
+
+print(string.format("Done in %.1f sec: %d devices OK, %d failed.", socket.gettime() - startTime, numOk, numFailed))
+if (numFailed > 0) then
+	os.exit(1)
+end
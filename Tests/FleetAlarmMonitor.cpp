@@ -0,0 +1,641 @@
+#define _CRT_SECURE_NO_WARNINGS 1
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include "fmt/format.h"
+#include "Recorder.hpp"
+#include "Root.hpp"
+
+
+
+
+
+using namespace NetSurveillancePp;
+
+using Clock = std::chrono::steady_clock;
+
+
+
+
+
+
+/** The first delay before reconnecting a device. Also the minimum delay between two connection attempts to
+the same device. */
+std::chrono::milliseconds gBackoffBase(500);
+
+/** The maximum delay before reconnecting a device. */
+std::chrono::milliseconds gBackoffCap(60000);
+
+/** A device needs to stay connected at least this long for its backoff to be reset after the next disconnect.
+Prevents a flapping device from reconnecting at the base rate forever. */
+std::chrono::seconds gStableConnectionTime(60);
+
+/** The interval between the status reports. */
+std::chrono::seconds gStatusInterval(10);
+
+/** The longest time a login may take; if the library doesn't report the result by then, the attempt is abandoned
+and counts as a failure. */
+std::chrono::seconds gLoginTimeout(30);
+
+
+
+
+
+/** A simple token bucket rate limiter. Not thread-safe, the caller needs to synchronize. */
+class TokenBucket
+{
+public:
+
+	TokenBucket(double aRatePerSec, double aBurst):
+		mRatePerSec(aRatePerSec),
+		mBurst(aBurst),
+		mTokens(aBurst),
+		mLastRefill(Clock::now())
+	{
+	}
+
+
+	/** Takes a single token, if available. Returns true if taken, false if the rate limit has been reached. */
+	bool tryTake(Clock::time_point aNow)
+	{
+		refill(aNow);
+		if (mTokens < 1)
+		{
+			return false;
+		}
+		mTokens -= 1;
+		return true;
+	}
+
+
+	/** Returns the time at which the next token will be available. */
+	Clock::time_point nextTokenTime(Clock::time_point aNow)
+	{
+		refill(aNow);
+		if (mTokens >= 1)
+		{
+			return aNow;
+		}
+		return aNow + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>((1 - mTokens) / mRatePerSec));
+	}
+
+
+protected:
+
+	/** The number of tokens added per second. */
+	double mRatePerSec;
+
+	/** The maximum number of tokens stored. */
+	double mBurst;
+
+	/** The number of tokens currently available. */
+	double mTokens;
+
+	/** The time when mTokens was last updated. */
+	Clock::time_point mLastRefill;
+
+
+	void refill(Clock::time_point aNow)
+	{
+		std::chrono::duration<double> elapsed = aNow - mLastRefill;
+		mTokens = std::min(mBurst, mTokens + elapsed.count() * mRatePerSec);
+		mLastRefill = aNow;
+	}
+};
+
+
+
+
+
+/** Keeps many devices logged in and monitoring alarms, reconnecting them whenever the connection fails.
+The reconnects are paced so that a site-wide outage doesn't end in a reconnect storm:
+	- each device waits a decorrelated-jitter backoff before each attempt,
+	- all devices share a global rate limit on the connection attempts,
+	- only a limited number of logins may be in progress at the same time,
+	- among the devices ready to reconnect, the ones with higher priority (lower number) go first.
+All the methods are thread-safe; the Recorder callbacks come in on the library's threads. */
+class FleetAlarmMonitor
+{
+public:
+
+	/** A single device, as read from the device list. */
+	struct DeviceConfig
+	{
+		std::string mHostName;
+		uint16_t mPort;
+		std::string mUserName;
+		std::string mPassword;
+
+		/** The order in which the devices are restored after an outage; lower number goes first. */
+		int mPriority;
+	};
+
+
+	FleetAlarmMonitor(std::vector<DeviceConfig> && aDevices, double aMaxConnectsPerSec, size_t aMaxLoginsInProgress):
+		mConnectRateLimit(aMaxConnectsPerSec, std::max(aMaxConnectsPerSec, 1.0)),
+		mMaxLoginsInProgress(aMaxLoginsInProgress),
+		mNumLoginsInProgress(0),
+		mRandom(std::random_device()())
+	{
+		auto now = Clock::now();
+		mDevices.reserve(aDevices.size());
+		for (auto & cfg: aDevices)
+		{
+			mDevices.emplace_back(std::move(cfg), now);
+		}
+	}
+
+
+	/** Runs the reconnect scheduling, never returns.
+	Wakes up whenever a device becomes ready to (re)connect, a rate-limit token becomes available, a device
+	disconnects, or a status report is due. */
+	void run()
+	{
+		auto nextStatus = Clock::now() + gStatusInterval;
+		std::unique_lock<std::mutex> lock(mMtx);
+		while (true)
+		{
+			auto now = Clock::now();
+			if (now >= nextStatus)
+			{
+				printStatus(now);
+				nextStatus = now + gStatusInterval;
+			}
+
+			// Release the Recorders of the dropped connections, outside of the lock:
+			if (!mRetiredRecorders.empty())
+			{
+				std::vector<std::shared_ptr<Recorder>> retired;
+				std::swap(retired, mRetiredRecorders);
+				lock.unlock();
+				retired.clear();
+				lock.lock();
+				continue;
+			}
+
+			// Abandon the logins that take too long, then pick the devices to connect now:
+			auto nextLoginDeadline = expireHungLogins(now);
+			std::vector<size_t> toConnect;
+			auto wakeUp = std::min(nextLoginDeadline, pickDevicesToConnect(now, toConnect));
+			for (auto idx: toConnect)
+			{
+				startConnecting(idx, lock);
+			}
+			if (!toConnect.empty())
+			{
+				// Connecting took some time and unlocked the mutex, re-evaluate:
+				continue;
+			}
+			mCvWakeUp.wait_until(lock, std::min(wakeUp, nextStatus));
+		}
+	}
+
+
+protected:
+
+	enum class State
+	{
+		Waiting,     // Waiting for the next connection attempt (mNextAttempt)
+		Connecting,  // connectAndLogin() is in progress
+		Connected,   // Logged in, monitoring alarms
+	};
+
+
+	/** The runtime state of a single device. Protected by mMtx. */
+	struct Device
+	{
+		DeviceConfig mConfig;
+		State mState;
+
+		/** The Recorder of the current connection attempt / connection. A new one is created for each attempt. */
+		std::shared_ptr<Recorder> mRecorder;
+
+		/** Incremented on each connection attempt; callbacks from the previous attempts' Recorders are ignored. */
+		unsigned mGeneration;
+
+		/** When to attempt the next connection, valid in the Waiting state. */
+		Clock::time_point mNextAttempt;
+
+		/** The last backoff used; the next one is derived from it. */
+		std::chrono::milliseconds mLastBackoff;
+
+		/** When the connection was lost (or the monitor started), for measuring the time to recover. */
+		Clock::time_point mDisconnectedSince;
+
+		/** When the current connection was established, valid in the Connected state. */
+		Clock::time_point mConnectedSince;
+
+		/** When the current login attempt is abandoned, valid in the Connecting state. */
+		Clock::time_point mLoginDeadline;
+
+		/** The number of failed connection attempts and dropped connections. */
+		unsigned mNumFailures;
+
+
+		Device(DeviceConfig && aConfig, Clock::time_point aNow):
+			mConfig(std::move(aConfig)),
+			mState(State::Waiting),
+			mGeneration(0),
+			mNextAttempt(aNow),
+			mLastBackoff(gBackoffBase),
+			mDisconnectedSince(aNow),
+			mNumFailures(0)
+		{
+		}
+	};
+
+
+	/** Protects all the member variables. */
+	std::mutex mMtx;
+
+	/** Notified whenever the scheduling needs to be re-evaluated. */
+	std::condition_variable mCvWakeUp;
+
+	std::vector<Device> mDevices;
+
+	/** The global limit on the connection attempts. */
+	TokenBucket mConnectRateLimit;
+
+	/** The maximum number of devices in the Connecting state. */
+	size_t mMaxLoginsInProgress;
+
+	/** The number of devices in the Connecting state. */
+	size_t mNumLoginsInProgress;
+
+	/** The randomness source for the backoff jitter. */
+	std::mt19937 mRandom;
+
+	/** The longest time to recover (reconnect) a device since the last status report. */
+	Clock::duration mMaxRecoveryTime = Clock::duration::zero();
+
+	/** The number of devices recovered since the last status report. */
+	size_t mNumRecovered = 0;
+
+	/** The Recorders of the dropped connections, to be released by run(), outside of mMtx.
+	The drops are detected in the Recorder's own callbacks; these hold their own reference to the Recorder for
+	their whole duration, so the Recorder is never destroyed while the callback's code is still running. */
+	std::vector<std::shared_ptr<Recorder>> mRetiredRecorders;
+
+
+	/** Fills aToConnect with the devices that may start connecting right now, in priority order, within the limits.
+	Returns the time when the scheduling should be re-evaluated at the latest. Expects mMtx to be locked. */
+	Clock::time_point pickDevicesToConnect(Clock::time_point aNow, std::vector<size_t> & aToConnect)
+	{
+		auto wakeUp = aNow + gStatusInterval;
+		std::vector<size_t> ready;
+		for (size_t i = 0; i < mDevices.size(); ++i)
+		{
+			const auto & dev = mDevices[i];
+			if (dev.mState != State::Waiting)
+			{
+				continue;
+			}
+			if (dev.mNextAttempt <= aNow)
+			{
+				ready.push_back(i);
+			}
+			else
+			{
+				wakeUp = std::min(wakeUp, dev.mNextAttempt);
+			}
+		}
+		if (ready.empty())
+		{
+			return wakeUp;
+		}
+
+		// Highest priority first, then the longest waiting:
+		std::sort(ready.begin(), ready.end(),
+			[this](size_t aIdx1, size_t aIdx2)
+			{
+				const auto & dev1 = mDevices[aIdx1];
+				const auto & dev2 = mDevices[aIdx2];
+				if (dev1.mConfig.mPriority != dev2.mConfig.mPriority)
+				{
+					return dev1.mConfig.mPriority < dev2.mConfig.mPriority;
+				}
+				return dev1.mNextAttempt < dev2.mNextAttempt;
+			}
+		);
+		for (auto idx: ready)
+		{
+			if (mNumLoginsInProgress + aToConnect.size() >= mMaxLoginsInProgress)
+			{
+				// Woken up by a login finishing
+				break;
+			}
+			if (!mConnectRateLimit.tryTake(aNow))
+			{
+				wakeUp = std::min(wakeUp, mConnectRateLimit.nextTokenTime(aNow));
+				break;
+			}
+			aToConnect.push_back(idx);
+		}
+		return wakeUp;
+	}
+
+
+	/** Abandons the login attempts that have passed their deadline: their callbacks are ignored from now on (by bumping
+	the generation) and the devices are scheduled for reconnecting.
+	Returns the earliest deadline of the remaining login attempts. Expects mMtx to be locked. */
+	Clock::time_point expireHungLogins(Clock::time_point aNow)
+	{
+		auto res = Clock::time_point::max();
+		for (auto & dev: mDevices)
+		{
+			if (dev.mState != State::Connecting)
+			{
+				continue;
+			}
+			if (dev.mLoginDeadline > aNow)
+			{
+				res = std::min(res, dev.mLoginDeadline);
+				continue;
+			}
+			std::cerr << fmt::format("{}:{}: Login timed out\n", dev.mConfig.mHostName, dev.mConfig.mPort);
+			dev.mGeneration += 1;
+			mNumLoginsInProgress -= 1;
+			scheduleReconnect(dev, aNow);
+		}
+		return res;
+	}
+
+
+	/** Starts connecting the specified device with a new Recorder.
+	Expects aLock to be locked, unlocks it while calling into the library (which may call the callback synchronously). */
+	void startConnecting(size_t aIdx, std::unique_lock<std::mutex> & aLock)
+	{
+		auto & dev = mDevices[aIdx];
+		dev.mState = State::Connecting;
+		dev.mLoginDeadline = Clock::now() + gLoginTimeout;
+		dev.mGeneration += 1;
+		dev.mRecorder = Recorder::create();
+		mNumLoginsInProgress += 1;
+		auto rec = dev.mRecorder;
+		auto generation = dev.mGeneration;
+		auto cfg = dev.mConfig;
+
+		// The callback mustn't keep the Recorder alive, it is dropped when the device is rescheduled:
+		std::weak_ptr<Recorder> weakRec(rec);
+		aLock.unlock();
+		rec->connectAndLogin(cfg.mHostName, cfg.mPort, cfg.mUserName, cfg.mPassword,
+			[this, aIdx, generation, weakRec](const std::error_code & aError)
+			{
+				onLoginFinished(aIdx, generation, weakRec.lock(), aError);
+			}
+		);
+		aLock.lock();
+	}
+
+
+	void onLoginFinished(size_t aIdx, unsigned aGeneration, std::shared_ptr<Recorder> aRecorder, const std::error_code & aError)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mMtx);
+			auto & dev = mDevices[aIdx];
+			if (dev.mGeneration != aGeneration)
+			{
+				return;
+			}
+			mNumLoginsInProgress -= 1;
+			if (aError || (aRecorder == nullptr))
+			{
+				std::cerr << fmt::format("{}:{}: Login failed: {}\n", dev.mConfig.mHostName, dev.mConfig.mPort, aError ? aError.message() : "Recorder gone");
+				scheduleReconnect(dev, Clock::now());
+				mCvWakeUp.notify_all();
+				return;
+			}
+			auto now = Clock::now();
+			dev.mState = State::Connected;
+			dev.mConnectedSince = now;
+			mMaxRecoveryTime = std::max(mMaxRecoveryTime, now - dev.mDisconnectedSince);
+			mNumRecovered += 1;
+			mCvWakeUp.notify_all();
+		}
+
+		// The callback mustn't keep the Recorder alive, but it holds it while running, so that the Recorder
+		// isn't released by run() while the callback is still in progress:
+		std::weak_ptr<Recorder> weakRec(aRecorder);
+		aRecorder->monitorAlarms(
+			[this, aIdx, aGeneration, weakRec](
+				const std::error_code & aAlarmError,
+				int aChannel,
+				bool aIsStart,
+				const std::string & aEventType,
+				const nlohmann::json & /* aWholeJson */
+			)
+			{
+				auto rec = weakRec.lock();
+				onAlarm(aIdx, aGeneration, aAlarmError, aChannel, aIsStart, aEventType);
+			}
+		);
+	}
+
+
+	void onAlarm(size_t aIdx, unsigned aGeneration, const std::error_code & aError, int aChannel, bool aIsStart, const std::string & aEventType)
+	{
+		std::unique_lock<std::mutex> lock(mMtx);
+		auto & dev = mDevices[aIdx];
+		if ((dev.mGeneration != aGeneration) || (dev.mState != State::Connected))
+		{
+			return;
+		}
+		if (aError)
+		{
+			std::cerr << fmt::format("{}:{}: Connection lost: {}\n", dev.mConfig.mHostName, dev.mConfig.mPort, aError.message());
+			auto now = Clock::now();
+			if (now - dev.mConnectedSince >= gStableConnectionTime)
+			{
+				dev.mLastBackoff = gBackoffBase;
+			}
+			dev.mDisconnectedSince = now;
+			scheduleReconnect(dev, now);
+			mCvWakeUp.notify_all();
+			return;
+		}
+		std::cout << fmt::format("{}:{}: Alarm received: Channel {}, IsStart: {}, EventType: {}\n",
+			dev.mConfig.mHostName, dev.mConfig.mPort, aChannel, aIsStart ? "true" : "false", aEventType
+		);
+	}
+
+
+	/** Moves the device into the Waiting state, with the next attempt after a decorrelated-jitter backoff:
+	a random delay between the base and three times the previous delay, capped.
+	The randomness spreads the devices that failed at the same moment, so that they don't retry in lockstep.
+	The device's Recorder is handed over to run() for releasing, as this is called with mMtx locked.
+	Expects mMtx to be locked. */
+	void scheduleReconnect(Device & aDevice, Clock::time_point aNow)
+	{
+		auto upper = std::max(gBackoffBase.count(), std::min(gBackoffCap.count(), aDevice.mLastBackoff.count() * 3));
+		std::uniform_int_distribution<std::chrono::milliseconds::rep> dist(gBackoffBase.count(), upper);
+		aDevice.mLastBackoff = std::chrono::milliseconds(dist(mRandom));
+		aDevice.mNextAttempt = aNow + aDevice.mLastBackoff;
+		aDevice.mState = State::Waiting;
+		aDevice.mNumFailures += 1;
+		if (aDevice.mRecorder != nullptr)
+		{
+			mRetiredRecorders.push_back(std::move(aDevice.mRecorder));
+			aDevice.mRecorder.reset();
+		}
+	}
+
+
+	/** Prints the number of devices in each state and the recovery statistics since the last report.
+	Expects mMtx to be locked. */
+	void printStatus(Clock::time_point aNow)
+	{
+		size_t numWaiting = 0, numConnecting = 0, numConnected = 0;
+		Clock::duration longestDown = Clock::duration::zero();
+		size_t numFailures = 0;
+		const Device * mostFailing = nullptr;
+		for (const auto & dev: mDevices)
+		{
+			numFailures += dev.mNumFailures;
+			if ((dev.mNumFailures > 0) && ((mostFailing == nullptr) || (dev.mNumFailures > mostFailing->mNumFailures)))
+			{
+				mostFailing = &dev;
+			}
+			switch (dev.mState)
+			{
+				case State::Waiting:
+				{
+					numWaiting += 1;
+					longestDown = std::max(longestDown, aNow - dev.mDisconnectedSince);
+					break;
+				}
+				case State::Connecting:
+				{
+					numConnecting += 1;
+					longestDown = std::max(longestDown, aNow - dev.mDisconnectedSince);
+					break;
+				}
+				case State::Connected:
+				{
+					numConnected += 1;
+					break;
+				}
+			}
+		}
+		std::cout << fmt::format(
+			"Status: {} connected, {} connecting, {} waiting (longest down {} ms); {} recovered since the last status, max recovery time {} ms\n",
+			numConnected, numConnecting, numWaiting,
+			std::chrono::duration_cast<std::chrono::milliseconds>(longestDown).count(),
+			mNumRecovered,
+			std::chrono::duration_cast<std::chrono::milliseconds>(mMaxRecoveryTime).count()
+		);
+		if (mostFailing != nullptr)
+		{
+			std::cout << fmt::format("  {} failures in total, the most ({}) on {}:{}\n",
+				numFailures, mostFailing->mNumFailures, mostFailing->mConfig.mHostName, mostFailing->mConfig.mPort
+			);
+		}
+		mNumRecovered = 0;
+		mMaxRecoveryTime = Clock::duration::zero();
+	}
+};
+
+
+
+
+
+/** Reads the device list from the specified file.
+Each non-empty line that doesn't start with a '#' specifies one device: "<host> <port> <username> <password> [<priority>]".
+The priority defaults to 0. Throws a std::runtime_error on failure. */
+static std::vector<FleetAlarmMonitor::DeviceConfig> readDeviceList(const char * aFileName)
+{
+	std::ifstream f(aFileName);
+	if (!f)
+	{
+		throw std::runtime_error(fmt::format("Cannot open the device list file {}", aFileName));
+	}
+	std::vector<FleetAlarmMonitor::DeviceConfig> res;
+	std::string line;
+	int lineNum = 0;
+	while (std::getline(f, line))
+	{
+		lineNum += 1;
+		if (line.empty() || (line[0] == '#'))
+		{
+			continue;
+		}
+		std::istringstream ss(line);
+		FleetAlarmMonitor::DeviceConfig cfg;
+		int port = 0;
+		if (!(ss >> cfg.mHostName >> port >> cfg.mUserName >> cfg.mPassword) || (port <= 0) || (port > 65535))
+		{
+			throw std::runtime_error(fmt::format("Cannot parse line {} of the device list: {}", lineNum, line));
+		}
+		cfg.mPort = static_cast<uint16_t>(port);
+		if (!(ss >> cfg.mPriority))
+		{
+			cfg.mPriority = 0;
+		}
+		res.push_back(std::move(cfg));
+	}
+	return res;
+}
+
+
+
+
+
+/** This tool keeps all the devices listed in a file logged in and monitoring alarms, printing the alarms received,
+reconnecting the devices whenever their connection fails, and periodically printing the fleet's status.
+Command-line parameters:
+	1. Device list file (see readDeviceList() for the format)
+	2. Maximum number of connection attempts per second, over all devices (20 by default)
+	3. Maximum number of logins in progress at the same time (50 by default)
+	4. Backoff base, in milliseconds (500 by default)
+	5. Backoff cap, in seconds (60 by default)
+	6. Status report interval, in seconds (10 by default)
+	7. Login timeout, in seconds (30 by default)
+*/
+int main(int aArgC, char * aArgV[])
+{
+	// Parse the cmdline arguments:
+	if (aArgC < 2)
+	{
+		std::cerr << "Usage: FleetAlarmMonitor <DeviceListFile> [<MaxConnectsPerSec> [<MaxLoginsInProgress> [<BackoffBaseMsec> [<BackoffCapSec> [<StatusIntervalSec> [<LoginTimeoutSec>]]]]]]\n";
+		return 1;
+	}
+	auto maxConnectsPerSec   = (aArgC < 3) ? 20 : std::atof(aArgV[2]);
+	auto maxLoginsInProgress = (aArgC < 4) ? 50 : std::atoi(aArgV[3]);
+	gBackoffBase             = std::chrono::milliseconds((aArgC < 5) ? 500 : std::atoi(aArgV[4]));
+	gBackoffCap              = std::chrono::seconds((aArgC < 6) ? 60 : std::atoi(aArgV[5]));
+	gStatusInterval          = std::chrono::seconds((aArgC < 7) ? 10 : std::atoi(aArgV[6]));
+	gLoginTimeout            = std::chrono::seconds((aArgC < 8) ? 30 : std::atoi(aArgV[7]));
+	if (
+		(maxConnectsPerSec <= 0) || (maxLoginsInProgress <= 0) || (gBackoffBase.count() <= 0) ||
+		(gBackoffCap < gBackoffBase) || (gStatusInterval.count() <= 0) || (gLoginTimeout.count() <= 0)
+	)
+	{
+		std::cerr << "Invalid limits, all must be positive and the backoff cap must not be lower than the base.\n";
+		return 1;
+	}
+
+	std::vector<FleetAlarmMonitor::DeviceConfig> devices;
+	try
+	{
+		devices = readDeviceList(aArgV[1]);
+	}
+	catch (const std::exception & exc)
+	{
+		std::cerr << exc.what() << "\n";
+		return 1;
+	}
+	std::cout << fmt::format("Monitoring alarms on {} devices, at most {} connects per second and {} logins in progress...\n",
+		devices.size(), maxConnectsPerSec, maxLoginsInProgress
+	);
+
+	FleetAlarmMonitor monitor(std::move(devices), maxConnectsPerSec, static_cast<size_t>(maxLoginsInProgress));
+	monitor.run();
+	return 0;
+}
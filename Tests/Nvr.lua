@@ -6,6 +6,8 @@ Implements the Nvr library, providing (synchronous) access to a real device
 Provides a Device class, representing a single device, created by calling this module's connect() method.
 The Device class implements methods for sending and receiving requests to and from the device; each call
 is blocking.
+Alternatively, a connection created by the connectCooperative() method never blocks, instead it yields the
+current coroutine whenever its socket is not ready, so that many connections can be driven by a single thread.
 --]]
 
 
@@ -45,6 +47,10 @@ local Connection =
 
 	-- The sequence number of the next packet to send
 	mSequenceNum = 0,
+
+	-- If true, the socket is non-blocking and the calls yield the current coroutine instead of blocking
+	-- (set by Nvr.connectCooperative())
+	mIsCooperative = false,
 }
 Connection.__index = Connection
 
@@ -79,6 +85,105 @@ end
 
 
 
+--- Connects to the specified hostname and port, in the cooperative mode
+-- Needs to be called from within a coroutine. Whenever the socket is not ready, the coroutine yields two
+-- values: "read" or "write", and the socket; it is expected to be resumed once the socket is ready for that
+-- (resuming early, such as on a timeout, is harmless, the operation is simply retried).
+-- Note that the hostname resolution is still blocking.
+-- Doesn't send any information yet.
+-- Returns a Connection object on success, nil and error message on failure
+function Nvr.connectCooperative(aHostName, aPort)
+	assert(type(aHostName) == "string")
+	assert(type(aPort) == "number")
+	assert(aPort > 0)
+	assert(aPort < 65536)
+	assert(coroutine.running(), "Cooperative connections need to be used from within a coroutine")
+
+	-- Connect the socket, waiting for the connection to complete:
+	local skt = socket.tcp()
+	skt:settimeout(0)
+	local isSuccess, msg = skt:connect(aHostName, aPort)
+	while not(isSuccess) do
+		if (msg == "already connected") then
+			break
+		end
+		if (msg ~= "timeout") and (msg ~= "Operation already in progress") then
+			skt:close()
+			return nil, msg
+		end
+		coroutine.yield("write", skt)
+		isSuccess, msg = skt:connect(aHostName, aPort)
+	end
+
+	-- Create a new Connection instance:
+	local res = {mSocket = skt, mIsCooperative = true}
+	setmetatable(res, Connection)
+
+	return res
+end
+
+
+
+
+
+--- Sends the raw data through the socket
+-- In the cooperative mode, yields until all the data is sent
+-- Returns the index of the last byte sent on success, nil and error message on failure
+function Connection:sendRaw(aData)
+	assert(type(aData) == "string")
+
+	if not(self.mIsCooperative) then
+		return self.mSocket:send(aData)
+	end
+	local start = 1
+	while (true) do
+		local lastSent, msg, partialLastSent = self.mSocket:send(aData, start)
+		if (lastSent) then
+			return lastSent
+		end
+		if (msg ~= "timeout") then
+			return nil, msg
+		end
+		start = partialLastSent + 1
+		coroutine.yield("write", self.mSocket)
+	end
+end
+
+
+
+
+
+--- Receives exactly the specified number of raw bytes from the socket
+-- In the cooperative mode, yields until all the data is received
+-- Returns the data on success, nil and error message on failure (including "timeout", if a timeout is set in the blocking mode)
+function Connection:receiveRaw(aNumBytes)
+	assert(type(aNumBytes) == "number")
+
+	if not(self.mIsCooperative) then
+		return self.mSocket:receive(aNumBytes)
+	end
+	local received = {}
+	while (true) do
+		local data, msg, partial = self.mSocket:receive(aNumBytes)
+		data = data or partial
+		if (data and (data ~= "")) then
+			received[#received + 1] = data
+			aNumBytes = aNumBytes - string.len(data)
+		end
+		if (aNumBytes <= 0) then
+			return table.concat(received)
+		end
+		if (msg ~= "timeout") then
+			return nil, msg
+		end
+		coroutine.yield("read", self.mSocket)
+	end
+end
+
+
+
+
+
 --- Sends the specified request through the connection
 -- The payload can be either a direct string to send, or a table, which will be first converted to JSON
 -- Returns true on success, nil and message on failure
@@ -94,11 +199,11 @@ function Connection:sendRequest(aMessageType, aPayload)
 
 	-- Send the data:
 	local isSuccess, msg
-	isSuccess, msg = self.mSocket:send(serializeHeader(self.mSessionID, self.mSequenceNum, aMessageType, string.len(aPayload)))
+	isSuccess, msg = self:sendRaw(serializeHeader(self.mSessionID, self.mSequenceNum, aMessageType, string.len(aPayload)))
 	if not(isSuccess) then
 		return nil, "Failed to send the header: " .. tostring(msg)
 	end
-	isSuccess, msg = self.mSocket:send(aPayload)
+	isSuccess, msg = self:sendRaw(aPayload)
 	if not(isSuccess) then
 		return nil, "Failed to send the payload: " .. tostring(msg)
 	end
@@ -117,7 +222,7 @@ end
 -- reported as success; use Connection:checkResponse() to process those
 function Connection:receiveResponse()
 	-- Receive the response data:
-	local resp, msg = self:receiveResponseData()
+	local resp, msg = self:receiveMultiPartResponseData()
 	if not(resp) then
 		return nil, "Failed to receive response data: " .. tostring(msg)
 	end
@@ -137,15 +242,20 @@ end
 
 
 
---- Receives a single response from the device on the Connection
+--- The size of the chunks in which Connection:receiveResponseToSink() passes the payload to the sink
+local gSinkChunkSize = 64 * 1024
+
+
+
+
+
+--- Receives and checks a single response header from the device on the Connection
 -- If aAllowLargePayload is true, doesn't check the PayloadLength
--- Returns the response as a raw string and the message type indicated in the protocol on success
--- Returns nil and message on failure
-function Connection:receiveResponseData(aAllowLargePayload)
+-- Returns the parsed header on success, nil and message on failure
+function Connection:receiveResponseHeader(aAllowLargePayload)
 	assert(not(aAllowLargePayload) or (aAllowLargePayload == true))
 
-	-- Receive the header:
-	local hdr, msg = self.mSocket:receive(20)
+	local hdr, msg = self:receiveRaw(20)
 	if not(hdr) then
 		if (msg == "timeout") then
 			return nil, "timeout"
@@ -164,17 +274,141 @@ function Connection:receiveResponseData(aAllowLargePayload)
 			return nil, "Not a NetSurveillanceProtocol, the PayloadLength is too large"
 		end
 	end
+	return parsedHdr
+end
+
+
+
+
+
+--- Receives a single response from the device on the Connection
+-- If aAllowLargePayload is true, doesn't check the PayloadLength
+-- Returns the response as a raw string, the message type indicated in the protocol and the parsed header on success
+-- Returns nil and message on failure
+function Connection:receiveResponseData(aAllowLargePayload)
+	local parsedHdr, msg = self:receiveResponseHeader(aAllowLargePayload)
+	if not(parsedHdr) then
+		return nil, msg
+	end
 
 	-- Receive the body
 	if (parsedHdr.PayloadLength == 0) then
-		return "", parsedHdr.MessageType
+		return "", parsedHdr.MessageType, parsedHdr
 	end
 	local body
-	body, msg = self.mSocket:receive(parsedHdr.PayloadLength)
+	body, msg = self:receiveRaw(parsedHdr.PayloadLength)
 	if not(body) then
 		return nil, "Failed to receive response data: " .. tostring(msg)
 	end
-	return body, parsedHdr.MessageType
+	return body, parsedHdr.MessageType, parsedHdr
+end
+
+
+
+
+
+--- Receives a single, possibly multi-part, response from the device on the Connection
+-- If the header's TotalPkt is larger than 1, the response is split into TotalPkt packets, numbered by CurrPkt
+-- from 0; all the parts are received, checked for consistency and their payloads joined together.
+-- Each part is checked with the same limits as in Connection:receiveResponseData().
+-- Returns the same values as Connection:receiveResponseData(); the header is the first part's one
+function Connection:receiveMultiPartResponseData(aAllowLargePayload)
+	local body, msg, hdr = self:receiveResponseData(aAllowLargePayload)
+	if not(body) then
+		return nil, msg
+	end
+	if (hdr.TotalPkt <= 1) then
+		return body, msg, hdr
+	end
+	if (hdr.CurrPkt ~= 0) then
+		return nil, "The multi-part response doesn't start with the first part (CurrPkt = " .. tostring(hdr.CurrPkt) .. ")"
+	end
+
+	-- Receive the rest of the parts:
+	local parts = { body }
+	for i = 1, hdr.TotalPkt - 1 do
+		local part, partMsg, partHdr = self:receiveResponseData(aAllowLargePayload)
+		if not(part) then
+			return nil, "Failed to receive part " .. i .. " of a multi-part response: " .. tostring(partMsg)
+		end
+		if (
+			(partHdr.MessageType ~= hdr.MessageType) or
+			(partHdr.TotalPkt ~= hdr.TotalPkt) or
+			(partHdr.CurrPkt ~= i)
+		) then
+			return nil, string.format(
+				"Unexpected part of a multi-part response: MessageType %d, TotalPkt %d, CurrPkt %d (expected %d, %d, %d)",
+				partHdr.MessageType, partHdr.TotalPkt, partHdr.CurrPkt, hdr.MessageType, hdr.TotalPkt, i
+			)
+		end
+		parts[i + 1] = part
+	end
+	return table.concat(parts), hdr.MessageType, hdr
+end
+
+
+
+
+
+--- Receives a single, possibly multi-part, response from the device on the Connection and passes its payload
+-- into aSink in chunks of at most gSinkChunkSize bytes, as it arrives, without buffering the whole payload
+-- The sink follows the LTN12 convention (so e.g. ltn12.sink.file() can be used): it is called with each chunk,
+-- and with nil once at the end (with an error message as the second param on failure); it returns a true
+-- value to continue, or nil and an error message to abort the receiving.
+-- The parts of a multi-part response are checked the same way as in Connection:receiveMultiPartResponseData().
+-- Returns the total payload size, the message type indicated in the protocol and the first part's parsed header on success
+-- Returns nil and message on failure
+function Connection:receiveResponseToSink(aSink, aAllowLargePayload)
+	assert(type(aSink) == "function")
+
+	local firstHdr
+	local numBytes = 0
+	local partIdx = 0
+	local function fail(aMsg)
+		aSink(nil, aMsg)
+		return nil, aMsg
+	end
+	repeat
+		local hdr, msg = self:receiveResponseHeader(aAllowLargePayload)
+		if not(hdr) then
+			return fail("Failed to receive part " .. partIdx .. " of the response: " .. tostring(msg))
+		end
+		if not(firstHdr) then
+			firstHdr = hdr
+			if ((hdr.TotalPkt > 1) and (hdr.CurrPkt ~= 0)) then
+				return fail("The multi-part response doesn't start with the first part (CurrPkt = " .. tostring(hdr.CurrPkt) .. ")")
+			end
+		elseif (
+			(hdr.MessageType ~= firstHdr.MessageType) or
+			(hdr.TotalPkt ~= firstHdr.TotalPkt) or
+			(hdr.CurrPkt ~= partIdx)
+		) then
+			return fail(string.format(
+				"Unexpected part of a multi-part response: MessageType %d, TotalPkt %d, CurrPkt %d (expected %d, %d, %d)",
+				hdr.MessageType, hdr.TotalPkt, hdr.CurrPkt, firstHdr.MessageType, firstHdr.TotalPkt, partIdx
+			))
+		end
+
+		-- Pass the part's payload to the sink, chunk by chunk:
+		local left = hdr.PayloadLength
+		while (left > 0) do
+			local chunk
+			chunk, msg = self:receiveRaw(math.min(left, gSinkChunkSize))
+			if not(chunk) then
+				return fail("Failed to receive response data: " .. tostring(msg))
+			end
+			local isSuccess, sinkMsg = aSink(chunk)
+			if not(isSuccess) then
+				return fail("The sink failed: " .. tostring(sinkMsg))
+			end
+			left = left - string.len(chunk)
+			numBytes = numBytes + string.len(chunk)
+		end
+		partIdx = partIdx + 1
+	until (partIdx >= firstHdr.TotalPkt)
+
+	aSink(nil)
+	return numBytes, firstHdr.MessageType, firstHdr
 end
 
 
@@ -392,6 +626,283 @@ end
 
 
 
+--- Receives the responses to the pipelined requests, one for each of aNames, in order
+-- All the responses are received even if some of them report a failure, so that the connection stays in sync.
+-- Only if a response cannot be received or parsed at all, the rest is not waited for, the connection is out of sync
+-- then and should be closed.
+-- Returns a dict-table of name -> response for the successful requests and an array-table of failures, each
+-- {name = ..., msg = ..., resp = ...}, the resp is nil for the responses that were not received.
+function Connection:receivePipelinedResponses(aNames)
+	assert(type(aNames) == "table")
+
+	local responses = {}
+	local failures = {}
+	for idx, name in ipairs(aNames) do
+		local isSuccess, msgType, resp = self:receiveAndCheckResponse()
+		if (isSuccess) then
+			responses[name] = resp
+		else
+			failures[#failures + 1] = {name = name, msg = tostring(msgType), resp = resp}
+			if not(resp) then
+				for i = idx + 1, #aNames do
+					failures[#failures + 1] = {name = aNames[i], msg = "Response not received"}
+				end
+				break
+			end
+		end
+	end
+	return responses, failures
+end
+
+
+
+
+
+--- Returns a single error message describing all the failures, as returned by receivePipelinedResponses(),
+-- and the first failed request's device response
+local function describeFailures(aFailures)
+	local msgs = {}
+	for idx, failure in ipairs(aFailures) do
+		msgs[idx] = failure.name .. ": " .. failure.msg
+	end
+	return table.concat(msgs, "; "), aFailures[1].resp
+end
+
+
+
+
+
+--- Retrieves the specified config from the device
+-- Returns the config value (the response's member named after the config) and the whole response on success
+-- On failure, returns nil, error message and possibly the device's response as a table parsed from JSON
+function Connection:getConfig(aConfigName)
+	assert(type(aConfigName) == "string")
+
+	local values, msg, resp = self:getConfigs({aConfigName})
+	if not(values) then
+		return nil, msg, resp
+	end
+	return values[aConfigName], resp
+end
+
+
+
+
+
+--- Retrieves the specified configs from the device, pipelined
+-- All the requests are sent first, then all the responses are received, so that the device's round-trip
+-- time is only paid once for the whole batch.
+-- aConfigNames is an array-table of the config names
+-- Returns a dict-table of ConfigName -> config value on success
+-- On failure, returns nil, an error message listing all the failed configs, possibly the first failed device's
+-- response as a table parsed from JSON, and a dict-table of ConfigName -> config value of the configs that were read
+function Connection:getConfigs(aConfigNames)
+	assert(type(self.mSocket) == "userdata")  -- We need a valid socket
+	assert(type(aConfigNames) == "table")
+
+	-- Send all the requests:
+	for _, name in ipairs(aConfigNames) do
+		local isSuccess, msg = self:sendRequest(MessageType.ConfigGet_Req,
+			{
+				Name = name,
+				SessionID = string.format("0x%x", self.mSessionID),
+			}
+		)
+		if not(isSuccess) then
+			return nil, msg
+		end
+	end
+
+	-- Receive all the responses, the device answers in order:
+	local responses, failures = self:receivePipelinedResponses(aConfigNames)
+	local res = {}
+	for _, name in ipairs(aConfigNames) do
+		local resp = responses[name]
+		if (resp) then
+			if (resp[name] == nil) then
+				failures[#failures + 1] = {name = name, msg = "The response is missing the config value", resp = resp}
+			else
+				res[name] = resp[name]
+			end
+		end
+	end
+	if (failures[1]) then
+		local msg, resp = describeFailures(failures)
+		return nil, msg, resp, res
+	end
+	return res
+end
+
+
+
+
+
+--- Sets the specified config on the device
+-- aValue is the whole new value of the config, as it would be returned by getConfig()
+-- Returns the device's response (parsed into a table) on success
+-- On failure, returns nil, error message and possibly the device's response as a table parsed from JSON
+function Connection:setConfig(aConfigName, aValue)
+	assert(type(aConfigName) == "string")
+	assert(aValue ~= nil)
+
+	local isSuccess, msg, resp = self:setConfigs({[aConfigName] = aValue})
+	if not(isSuccess) then
+		return nil, msg, resp
+	end
+	return resp
+end
+
+
+
+
+
+--- Sets the specified configs on the device, pipelined
+-- aConfigs is a dict-table of ConfigName -> whole new config value
+-- All the requests are sent first (in the alphabetical order of the config names), then all the responses are received
+-- Returns true and the last device's response (parsed into a table) on success
+-- On failure, returns nil, an error message listing all the failed configs, possibly the first failed device's
+-- response as a table parsed from JSON, and an array-table of the names of the configs that were set.
+-- Note that the device processes all the requests regardless of a failure of any of them, so on failure all the
+-- configs that are not listed in the error message have been set. If a response couldn't be received, it is not
+-- known whether that config (and any following) was set; these are listed in the error message, too.
+function Connection:setConfigs(aConfigs)
+	assert(type(self.mSocket) == "userdata")  -- We need a valid socket
+	assert(type(aConfigs) == "table")
+
+	local names = {}
+	for name, _ in pairs(aConfigs) do
+		names[#names + 1] = name
+	end
+	table.sort(names)
+
+	-- Send all the requests:
+	for _, name in ipairs(names) do
+		local isSuccess, msg = self:sendRequest(MessageType.ConfigSet_Req,
+			{
+				Name = name,
+				[name] = aConfigs[name],
+				SessionID = string.format("0x%x", self.mSessionID),
+			}
+		)
+		if not(isSuccess) then
+			return nil, msg
+		end
+	end
+
+	-- Receive all the responses, the device answers in order:
+	local responses, failures = self:receivePipelinedResponses(names)
+	if (failures[1]) then
+		local setNames = {}
+		for _, name in ipairs(names) do
+			if (responses[name]) then
+				setNames[#setNames + 1] = name
+			end
+		end
+		local msg, resp = describeFailures(failures)
+		return nil, msg, resp, setNames
+	end
+	return true, responses[names[#names]]
+end
+
+
+
+
+
+--- The maximum number of files a device returns in a single OPFileQuery response
+-- Used only for the devices that don't tell whether there are more files (answer with a plain Ret = Success): if such
+-- a response contains this many files, there may be more and the query is repeated from the last file on
+local gMaxFilesPerQuery = 64
+
+
+
+
+
+--- Searches for the recorded files on the specified channel between the specified times
+-- aBeginTime and aEndTime are UNIX timestamps (interpreted in the local timezone, same as the device)
+-- aEvent is the event mask string, a combination of A (alarm), M (motion), R (regular) and H (manual); defaults to "AMRH" (all)
+-- The device returns the files in pages; the following pages are requested automatically, each starting
+-- at the end of the last file of the previous page, for as long as the device answers SearchSuccessReturnSome
+-- Returns an array-table of the files (as returned by the device, with FileName, BeginTime, EndTime, ...)
+-- On failure, returns nil, error message and possibly the device's response as a table parsed from JSON
+function Connection:searchFiles(aChannel, aBeginTime, aEndTime, aEvent)
+	assert(type(self.mSocket) == "userdata")  -- We need a valid socket
+	assert(type(aChannel) == "number")
+	assert(type(aBeginTime) == "number")
+	assert(type(aEndTime) == "number")
+	assert(not(aEvent) or (type(aEvent) == "string"))
+
+	local res = {}
+	local seen = {}
+	local beginTime = os.date("%Y-%m-%d %H:%M:%S", aBeginTime)
+	local endTime = os.date("%Y-%m-%d %H:%M:%S", aEndTime)
+	while (true) do
+		-- Send the request for the next page:
+		local isSuccess, msg = self:sendRequest(MessageType.FileSearch_Req,
+			{
+				Name = "OPFileQuery",
+				OPFileQuery =
+				{
+					BeginTime = beginTime,
+					Channel = aChannel,
+					DriverTypeMask = "0x0000FFFF",
+					EndTime = endTime,
+					Event = aEvent or "AMRH",
+					Type = "h264",
+				},
+				SessionID = string.format("0x%x", self.mSessionID),
+			}
+		)
+		if not(isSuccess) then
+			return nil, msg
+		end
+
+		-- Receive the response; no files on a follow-up page simply means there are no more:
+		local resp, msgType
+		isSuccess, msgType, resp = self:receiveAndCheckResponse()
+		if not(isSuccess) then
+			if (res[1] and (type(resp) == "table") and (resp.Ret == Error.NoFileFound)) then
+				break
+			end
+			return nil, msgType, resp
+		end
+
+		-- Collect the files, skipping those already received on the previous page (the page boundary file is repeated):
+		local files = resp.OPFileQuery
+		if ((type(files) ~= "table") or not(files[1])) then
+			break
+		end
+		local numNew = 0
+		for _, file in ipairs(files) do
+			local key = tostring(file.FileName) .. "|" .. tostring(file.BeginTime)
+			if not(seen[key]) then
+				seen[key] = true
+				res[#res + 1] = file
+				numNew = numNew + 1
+			end
+		end
+
+		-- Continue from the last file's end, unless this was the last page or there's no progress:
+		local hasMore
+		if (resp.Ret == Error.SearchSuccessReturnSome) then
+			hasMore = true
+		elseif (resp.Ret == Error.SearchSuccessReturnAll) then
+			hasMore = false
+		else
+			hasMore = (#files >= gMaxFilesPerQuery)
+		end
+		local lastEnd = files[#files].EndTime
+		if (not(hasMore) or (numNew == 0) or (type(lastEnd) ~= "string") or (lastEnd <= beginTime)) then
+			break
+		end
+		beginTime = lastEnd
+	end
+	return res
+end
+
+
+
+
+
 --- Sends the KeepAlive packet and waits for the response
 -- Returns the KeepAlive response body as parsed JSON on success.
 -- Returns nil and error message on failure.
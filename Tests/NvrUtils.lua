@@ -311,7 +311,7 @@ function writeUint32(aValue)
 	assert(aValue >= 0)
 
 	return string.char(
-		aValue % 0xff,
+		aValue % 256,
 		math.floor(aValue / 256) % 256,
 		math.floor(aValue / 65536) % 256,
 		math.floor(aValue / 65536 / 256) % 256
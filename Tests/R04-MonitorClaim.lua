@@ -12,6 +12,8 @@ Tested on firmwares:
 Seems to work on all. If there's a mismatch between the channels in the OPMonitor-Claim and OPMonitor-Start
 packets, returns a 103 error.
 The device may send both video and audio frames.
+The stream type can be given as the only cmdline param: "Main" (default) or "Extra" (the device's
+lower-resolution secondary stream).
 --]]
 
 
@@ -61,6 +63,9 @@ end
 
 
 
+--- The stream type to request, from the cmdline:
+local gStreamType = ({...})[1] or "Main"
+
 --- The output file, once it is open for writing
 local gFileOut
 
@@ -80,6 +85,42 @@ local gFileExt =
 
 
 
+--- Map of stream format (T byte in the I-frame header) to codec name, for the frame descriptions
+local gCodecName =
+{
+	[1] = "MPEG-4",
+	[2] = "H.264",
+	[3] = "H.265",
+}
+
+
+
+
+
+--- Returns the human-readable description of the I-frame header at the start of gBuffer
+-- The header is 16 bytes: signature (4), format (1), fps (1), width / 8 (1), height / 8 (1),
+-- packed device timestamp (4) and Length (4)
+local function describeIFrameHeader()
+	local format, fps, width, height = string.byte(gBuffer, 5, 8)
+	local ts = parseUint32(string.sub(gBuffer, 9, 12))
+	return string.format("%s, %d fps, %dx%d, device time %04d-%02d-%02d %02d:%02d:%02d",
+		gCodecName[format % 16] or ("format " .. tostring(format % 16)),
+		fps,
+		width * 8,
+		height * 8,
+		math.floor(ts / 67108864) % 64 + 2000,  -- year: bits 26 - 31
+		math.floor(ts / 4194304) % 16,          -- month: bits 22 - 25
+		math.floor(ts / 131072) % 32,           -- day: bits 17 - 21
+		math.floor(ts / 4096) % 32,             -- hour: bits 12 - 16
+		math.floor(ts / 64) % 64,               -- minute: bits 6 - 11
+		ts % 64                                 -- second: bits 0 - 5
+	)
+end
+
+
+
+
+
 --- Processes a single frame in gBuffer
 -- aLengthOffset specifies the offset into gBuffer from which the Length field should be read
 -- aLengthSize specifies the number of bytes of the Length field; must be 2 or 4
@@ -131,15 +172,20 @@ local function processPacket(aData)
 			print("Saving to file " .. fileName .. ", format " .. tostring(format))
 			gFileOut = assert(io.open(fileName, "wb"))
 		end
-		print("I-frame")
+		if (len >= 16) then
+			print("I-frame: " .. describeIFrameHeader())
+		else
+			print("I-frame")
+		end
 		return processFrame(13, 4)
 	elseif (bytes[4] == 0xfd) then
 		-- P-frame, 8 bytes long header
 		print("P-frame")
 		return processFrame(5, 4)
 	elseif (bytes[4] == 0xfa) then
-		-- Audio frame, 8 bytes long header, 2-bytes long Length
-		print("audio-frame")
+		-- Audio frame, 8 bytes long header: signature (4), format (1), sample rate code (1), 2-bytes long Length
+		local format, sampleRate = string.byte(gBuffer, 5, 6)
+		print(string.format("audio-frame: format %d, sample rate code %d", format, sampleRate))
 		return processFrame(7, 2)
 	end
 	assert(false, "Unhandled message type: " .. string.format("%02x", bytes[4]))
@@ -167,7 +213,7 @@ assert(cnMon:sendRequest(MessageType.MonitorClaim_Req,
 			{
 				Channel = 1,
 				CombinMode = "NONE",
-				StreamType = "Main",
+				StreamType = gStreamType,
 				TransMode = "TCP"
 			}
 		},
@@ -188,7 +234,7 @@ assert(cnMain:sendRequest(MessageType.Monitor_Req,
 			{
 				Channel = 1,
 				CombinMode = "NONE",
-				StreamType = "Main",
+				StreamType = gStreamType,
 				TransMode = "TCP"
 			}
 		},
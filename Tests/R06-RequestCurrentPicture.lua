@@ -2,7 +2,7 @@
 
 --[[
 Requests a picture of the current live video from a device, using the under-documented NET_SNAP_REQ message.
-Stores the received picture to a file.
+Stores the received picture to a file, writing it in chunks as it arrives.
 
 Tested on firmwares:
 	- V4.03.R11.J5980233.12201.140000.0000001 (NVR)
@@ -22,6 +22,7 @@ snapshot requests, not even a day of inactivity and session closure clears the t
 
 
 local nvr = require("Nvr")
+local ltn12 = require("ltn12")
 
 -- The specific real device's configuration, provide your own as needed (there's a RealDeviceConfig.sample.lua)
 local config = require("RealDeviceConfig")
@@ -41,8 +42,7 @@ assert(dev:sendRequest(MessageType.NetSnap_Req,
 		}
 	}
 ))
-local pic, msgType = assert(dev:receiveResponseData(true))
-local f = assert(io.open("pic.jpg", "wb"))
-f:write(pic)
-f:close()
-print("Done.")
+
+-- Write the picture into the file as it arrives, without buffering it whole (the sink closes the file at the end):
+local numBytes = assert(dev:receiveResponseToSink(ltn12.sink.file(assert(io.open("pic.jpg", "wb"))), true))
+print("Done, received " .. numBytes .. " bytes.")
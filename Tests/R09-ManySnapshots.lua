@@ -35,7 +35,7 @@ for i = 1, N do
 	))
 end
 for i = 1, N do
-	local pic, msgType = assert(dev:receiveResponseData(true))
+	local pic, msgType = assert(dev:receiveMultiPartResponseData(true))
 	if (
 		(string.len(pic) < 1000) and
 		string.find(pic, "Ret:"))
@@ -20,29 +20,17 @@ local config = require("RealDeviceConfig")
 
 local dev = assert(nvr.connect(config.hostName, config.port))
 assert(dev:login(config.username, config.passwordHash))
-local req = 
-{
-	Name = "OPFileQuery",
-	OPFileQuery =
-	{
-		BeginTime = os.date("%Y-%m-%d %H:%M:%S", os.time() - 24 * 60 * 60),
-		Channel = 0,
-		DriverTypeMask = "0x0000FFFF",
-		EndTime = os.date("%Y-%m-%d %H:%M:%S"),
-		Event = "AMRH",
-		Type = "h264"
-	},
-}
-print("Request:")
-utils.printTable(req)
-dev:sendRequest(MessageType.FileSearch_Req, req)
-local isSuccess, msgType, resp = dev:receiveAndCheckResponse()
-if not(isSuccess) then
-	print("NOT successful: " .. tostring(msgType))
+
+-- Query the last 24 hours of all kinds of recordings on channel 0, following all the result pages:
+local files, msg, resp = dev:searchFiles(0, os.time() - 24 * 60 * 60, os.time(), "AMRH")
+if not(files) then
+	print("NOT successful: " .. tostring(msg))
 	if (type(resp) == "table") then
 		utils.printTable(resp)
 	end
 else
-	print("Received SUCCESS response:")
-	utils.printTable(resp)
+	print("Received SUCCESS response, " .. #files .. " files:")
+	for _, file in ipairs(files) do
+		print(string.format("  %s - %s: %s (%s)", tostring(file.BeginTime), tostring(file.EndTime), tostring(file.FileName), tostring(file.FileLength)))
+	end
 end
@@ -3,6 +3,8 @@
 --[[
 Connects to a real device and downloads a short clip of the live stream, as raw data.
 The data needs to be further parsed in order to extract the actual video stream.
+The stream type can be given as the only cmdline param: "Main" (default) or "Extra" (the device's
+lower-resolution secondary stream).
 --]]
 
 
@@ -13,6 +15,12 @@ local utils = require("Utils")
 
 
 
+--- The stream type to request, from the cmdline:
+local gStreamType = ({...})[1] or "Main"
+
+
+
+
 
 -- The specific real device's configuration, provide your own as needed (there's a RealDeviceConfig.sample.lua)
 local config = require("RealDeviceConfig")
@@ -41,7 +49,7 @@ local reqClaim =
 		{
 			Channel = 0,
 			CombinMode = "NONE",
-			StreamType = "Main",
+			StreamType = gStreamType,
 			TransMode = "TCP",
 		},
 	},
@@ -56,7 +64,7 @@ local reqStart =
 		{
 			Channel = 0,
 			CombinMode = "NONE",
-			StreamType = "Main",
+			StreamType = gStreamType,
 			TransMode = "TCP",
 		},
 	},
@@ -0,0 +1,127 @@
+-- R17-SharedSessionMultiChannel.lua
+
+--[[
+Connects to a real device, logs in once using the control connection and then claims the live video of
+several channels, each on its own data connection, all of them reusing the control connection's SessionID.
+This checks whether a single logged-in session can carry many concurrent streams, as opposed to one login
+per stream (which quickly exhausts the device's session limit, see R11).
+Each channel's raw data is saved to a separate R17-out-<channel>.raw file.
+The stream type can be given as the only cmdline param: "Main" (default) or "Extra" (the device's
+lower-resolution secondary stream).
+--]]
+
+
+
+local nvr = require("Nvr")
+local utils = require("Utils")
+
+
+
+
+--- The number of channels to claim, starting at channel 0:
+local gNumChannels = 4
+
+--- The number of packets to receive from each channel:
+local gNumPacketsPerChannel = 20
+
+--- The stream type to request, from the cmdline:
+local gStreamType = ({...})[1] or "Main"
+
+
+
+
+-- The specific real device's configuration, provide your own as needed (there's a RealDeviceConfig.sample.lua)
+local config = require("RealDeviceConfig")
+
+
+
+
+
+--- Returns the OPMonitor request for the specified action and channel
+local function monitorRequest(aAction, aChannel)
+	assert(type(aAction) == "string")
+	assert(type(aChannel) == "number")
+
+	return
+	{
+		Name = "OPMonitor",
+		OPMonitor =
+		{
+			Action = aAction,
+			Parameter =
+			{
+				Channel = aChannel,
+				CombinMode = "NONE",
+				StreamType = gStreamType,
+				TransMode = "TCP",
+			},
+		},
+	}
+end
+
+
+
+
+
+-- Log in once, on the control connection:
+local devControl = assert(nvr.connect(config.hostName, config.port))
+assert(devControl:login(config.username, config.passwordHash))
+print("Logged in, SessionID = " .. tostring(devControl.mSessionID))
+
+-- Claim and start each channel on its own data connection, sharing the SessionID:
+local devData = {}
+for ch = 0, gNumChannels - 1 do
+	local conn = assert(nvr.connect(config.hostName, config.port))
+	conn.mSessionID = devControl.mSessionID
+
+	print("Claiming channel " .. ch .. " through its data connection:")
+	conn:sendRequest(MessageType.MonitorClaim_Req, monitorRequest("Claim", ch))
+	local isSuccess, msgType, resp = conn:receiveAndCheckResponse()
+	if not(isSuccess) then
+		print("  Claim NOT successful: " .. tostring(msgType))
+		if (type(resp) == "table") then
+			utils.printTable(resp)
+		end
+	else
+		print("Starting channel " .. ch .. " through the control connection:")
+		devControl:sendRequest(MessageType.Monitor_Req, monitorRequest("Start", ch))
+		isSuccess, msgType, resp = devControl:receiveAndCheckResponse()
+		if not(isSuccess) then
+			print("  Start NOT successful: " .. tostring(msgType))
+			if (type(resp) == "table") then
+				utils.printTable(resp)
+			end
+		else
+			devData[ch] = conn
+		end
+	end
+end
+
+-- Receive the data from all the started channels, round-robin:
+local numBytes = {}
+local fOut = {}
+for ch, _ in pairs(devData) do
+	numBytes[ch] = 0
+	fOut[ch] = assert(io.open("R17-out-" .. ch .. ".raw", "wb"))
+end
+for i = 1, gNumPacketsPerChannel do
+	for ch, conn in pairs(devData) do
+		local data, msgType = conn:receiveResponseData(false)
+		if not(data) then
+			print("Channel " .. ch .. ", response #" .. i .. " failed: " .. tostring(msgType))
+		else
+			numBytes[ch] = numBytes[ch] + string.len(data)
+			fOut[ch]:write(data)
+		end
+	end
+end
+
+-- Check that the control session survived all of the above:
+assert(devControl:sendRecvKeepAlive())
+
+print("Received data per channel:")
+for ch, n in pairs(numBytes) do
+	fOut[ch]:close()
+	print("  Channel " .. ch .. ": " .. n .. " bytes")
+end
+print("Done.")
@@ -0,0 +1,204 @@
+-- R18-DownloadPlayback.lua
+
+--[[
+Connects to a real device and downloads a whole recording file, as raw data, as fast as the device sends it.
+Unlike R16, which uses the playback semantics (the device paces the data at roughly real time), this uses the
+device's file download action ("DownloadStart"); if the device refuses it, falls back to the regular playback.
+The data is written into R18-out.raw in large blocks, progress and the achieved throughput are reported.
+
+Cmdline params, all optional:
+	1. The action to request: "DownloadStart" (default) or "Start" (regular playback, for comparison)
+	2. The remote filename to download (use R14 to find one)
+	3. The config module to use instead of RealDeviceConfig; "SimulatorConfig" measures against the SimpleSimulator,
+	which serves the playback unpaced (this is how the R18-DownloadPlayback-test runs it).
+--]]
+
+
+
+local nvr = require("Nvr")
+local utils = require("Utils")
+local socket = require("socket")
+
+
+
+
+local args = {...}
+
+--- The action to request in the Start request, from the cmdline:
+local gAction = args[1] or "DownloadStart"
+
+--- The filename of the recording to be downloaded:
+local gFileName = args[2] or "/idea0/2025-07-25/001/12.00.00-12.37.37[R][@104b0a][0].h264"
+
+--- The start time of the recording to be downloaded:
+local gStartTime = os.time(
+{
+	year = 2025,
+	month = 07,
+	day = 25,
+	hour = 12,
+	minute = 0,
+	second = 0
+})
+
+--- The size of the blocks written to the output file. The received data is collected until a whole block is available.
+local gWriteBlockSize = 1024 * 1024
+
+--- The interval, in seconds, between the progress reports:
+local gProgressInterval = 1
+
+--- The time, in seconds, to wait for the next data packet before giving up:
+local gDataTimeout = 10
+
+
+
+
+-- The specific real device's configuration, provide your own as needed (there's a RealDeviceConfig.sample.lua)
+local config = require(args[3] or "RealDeviceConfig")
+
+
+
+
+
+--- Returns the OPPlayBack request for the specified action
+local function playBackRequest(aAction)
+	assert(type(aAction) == "string")
+
+	return
+	{
+		Name = "OPPlayBack",
+		OPPlayBack =
+		{
+			Action = aAction,
+			StartTime = os.date("%Y-%m-%d %H:%M:%S", gStartTime),
+			EndTime = os.date("%Y-%m-%d %H:%M:%S", gStartTime + 60 * 60),
+			Parameter =
+			{
+				FileName = gFileName,
+				PlayMode = "ByName",
+				TransMode = "TCP",
+				Value = 0,
+			},
+		},
+	}
+end
+
+
+
+
+
+--- Sends the specified request and prints the result
+-- Returns true on success, false on failure
+local function sendAndCheck(aConnection, aMessageType, aRequest, aDescription)
+	aConnection:sendRequest(aMessageType, aRequest)
+	local isSuccess, msgType, resp = aConnection:receiveAndCheckResponse()
+	if not(isSuccess) then
+		print(aDescription .. " NOT successful: " .. tostring(msgType))
+		if (type(resp) == "table") then
+			utils.printTable(resp)
+		end
+		return false
+	end
+	print(aDescription .. " successful.")
+	return true
+end
+
+
+
+
+
+--- Collects the received data and writes it into the output file in whole blocks of gWriteBlockSize bytes
+local BlockWriter = {}
+BlockWriter.__index = BlockWriter
+
+function BlockWriter.new(aFileName)
+	local f = assert(io.open(aFileName, "wb"))
+	f:setvbuf("no")  -- The writes are already large, don't copy them through another buffer
+	return setmetatable({mFile = f, mPending = {}, mNumPending = 0}, BlockWriter)
+end
+
+--- Queues the data; writes out as many whole blocks as are available
+function BlockWriter:write(aData)
+	self.mPending[#self.mPending + 1] = aData
+	self.mNumPending = self.mNumPending + string.len(aData)
+	if (self.mNumPending < gWriteBlockSize) then
+		return
+	end
+	local all = table.concat(self.mPending)
+	local numWhole = self.mNumPending - self.mNumPending % gWriteBlockSize
+	assert(self.mFile:write(string.sub(all, 1, numWhole)))
+	self.mPending = {string.sub(all, numWhole + 1)}
+	self.mNumPending = self.mNumPending - numWhole
+end
+
+--- Writes out the remaining data and closes the file
+function BlockWriter:close()
+	assert(self.mFile:write(table.concat(self.mPending)))
+	self.mPending = {}
+	self.mNumPending = 0
+	self.mFile:close()
+end
+
+
+
+
+
+local devControl = assert(nvr.connect(config.hostName, config.port))
+assert(devControl:login(config.username, config.passwordHash))
+local devData = assert(nvr.connect(config.hostName, config.port))
+devData.mSessionID = devControl.mSessionID
+
+print("Claiming the playback of " .. gFileName .. " through the Data connection:")
+assert(sendAndCheck(devData, MessageType.PlayClaim_Req, playBackRequest("Claim"), "Claim"))
+
+print("Starting the playback with action " .. gAction .. " through the Control connection:")
+if not(sendAndCheck(devControl, MessageType.Play_Req, playBackRequest(gAction), gAction)) then
+	assert(gAction ~= "Start", "The device refused the playback")
+	print("Falling back to the regular playback.")
+	gAction = "Start"
+	assert(sendAndCheck(devControl, MessageType.Play_Req, playBackRequest(gAction), gAction))
+end
+
+-- Receive the data packets until the EOF:
+local out = BlockWriter.new("R18-out.raw")
+devData:setTimeout(gDataTimeout)
+local startTime = socket.gettime()
+local lastReportTime = startTime
+local lastReportBytes = 0
+local numBytes = 0
+local numPackets = 0
+while (true) do
+	local data, msgType = devData:receiveResponseData(true)
+	if not(data) then
+		print("Receiving the data failed: " .. tostring(msgType))
+		break
+	end
+	if (msgType == MessageType.Play_Eof) then
+		print("Received the EOF.")
+		break
+	end
+	if ((msgType ~= MessageType.DownloadData) and (msgType ~= MessageType.Play_Data)) then
+		print("Received an unexpected message type " .. tostring(msgType) .. ", stopping.")
+		break
+	end
+	out:write(data)
+	numBytes = numBytes + string.len(data)
+	numPackets = numPackets + 1
+
+	local now = socket.gettime()
+	if (now - lastReportTime >= gProgressInterval) then
+		print(string.format("  %d packets, %.1f MiB, currently %.2f MiB/s",
+			numPackets, numBytes / 1048576, (numBytes - lastReportBytes) / (now - lastReportTime) / 1048576
+		))
+		lastReportTime = now
+		lastReportBytes = numBytes
+	end
+end
+out:close()
+local elapsed = math.max(socket.gettime() - startTime, 0.001)
+
+devControl:sendRequest(MessageType.Play_Req, playBackRequest(gAction == "DownloadStart" and "DownloadStop" or "Stop"))
+
+print(string.format("Received %d packets, %d bytes in %.2f sec using %s: %.2f MiB/s on average.",
+	numPackets, numBytes, elapsed, gAction, numBytes / elapsed / 1048576
+))
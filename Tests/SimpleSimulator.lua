@@ -9,9 +9,17 @@ through the SimpleSimulatorDriver script that starts it in tandem with a tested
 
 The simulator accepts a hard-coded login of goodUser / goodPassword, it refuses any other combination.
 
+Multiple connections are served at the same time, so that a control connection and a data connection
+(such as for remote playback) can be used together. Each connection is handled in its own coroutine
+and keeps its own login state, Session ID and sequence numbers; a data connection doesn't log in, it
+adopts the session of the logged-in control connection whose Session ID it sends in the playback claim.
+Remote playback and download (OPPlayBack "Start" / "DownloadStart") serve the data as fast as the
+socket accepts it, with no real-time pacing, so that the client's throughput can be measured.
+
 The following cmdline params are accepted:
 --use-timeout - Set a 10-second timeout on the server socket; exits if there's no incoming connection within that time.
---singleshot - Only accept 1 connection, then exits
+--singleshot - Only serve 1 connection (plus the data connections opened while it is alive), then exits
+--playback-file <path> - The raw CapturedStream file to serve for remote playback; a synthetic stream is generated if not given
 --]]
 
 
@@ -25,17 +33,49 @@ dofile("NvrUtils.lua")
 -- Set by the "--singleshot" cmdline param
 local gIsSingleShot = false
 
---- The Session ID to be reported to the library
-local gSessionID = 0
-
---- The Sequence number to be used for the protocol. Incremented after each packet sent.
-local gSequenceNum = 0
-
---- True if the client logged in successfully, false if not.
-local gIsLoggedIn = false
-
---- True if the client asked for alarm notifications.
-local gWantsAlarms = false
+--- The protocol state of each connected client, as client socket -> state table with these members:
+-- isLoggedIn - true if the client logged in successfully on this connection
+-- sessionID - the Session ID reported to the client; assigned on login, or adopted from the control
+--   connection when a data connection claims the playback
+-- sequenceNum - the Sequence number to be used for the protocol, incremented after each packet sent
+-- playbackClient - for a control connection, the data connection that claimed its playback, or nil if none
+local gClientStates = {}
+
+--- The Session ID to be assigned to the next client that logs in
+local gNextSessionID = 0x0d
+
+--- The client that asked for alarm notifications, or nil if none.
+local gAlarmClient = nil
+
+--- The name of the raw CapturedStream file to serve for remote playback.
+-- Set by the "--playback-file" cmdline param; if nil, a synthetic stream is served
+local gPlaybackFileName = nil
+
+--- The size of the payload in a single playback data packet.
+local gPlaybackPacketSize = 32 * 1024
+
+--- The device's configuration, as ConfigName -> value. Served by ConfigGet and modified by ConfigSet
+local gConfigs =
+{
+	["General.General"] =
+	{
+		LocalNo = 8,
+		AutoLogout = 0,
+		ScreenAutoShutdown = 10,
+		ScreenSaveTime = 0,
+		OverWrite = "OverWrite",
+		VideoOutPut = "AUTO",
+		MachineName = "XiongMai",
+		SnapInterval = 2,
+	},
+	["Detect.MotionDetect"] =
+	{
+		{ Enable = true, Level = 3, EventHandler = { RecordEnable = true, SnapEnable = false } },
+		{ Enable = true, Level = 3, EventHandler = { RecordEnable = true, SnapEnable = false } },
+		{ Enable = false, Level = 3, EventHandler = { RecordEnable = false, SnapEnable = false } },
+		{ Enable = false, Level = 3, EventHandler = { RecordEnable = false, SnapEnable = false } },
+	},
+}
 
 --- Number of timeouts that need to happen before an alarm is sent to the client
 -- Decremented upon each timeout; when it reaches zero, an alarm is sent and this timer reset to another random value
@@ -48,6 +88,64 @@ local args = {...}
 
 
 
+--- Returns the protocol state of the specified client, creating a fresh (not logged in) one if needed
+local function clientState(aClient)
+	assert(type(aClient) == "userdata")
+
+	local state = gClientStates[aClient]
+	if not(state) then
+		state = {isLoggedIn = false, sessionID = 0, sequenceNum = 0}
+		gClientStates[aClient] = state
+	end
+	return state
+end
+
+
+
+
+
+--- Returns the client's Session ID formatted the way the responses report it
+local function sessionIDString(aClient)
+	return string.format("0x%08X", clientState(aClient).sessionID)
+end
+
+
+
+
+
+--- Returns the logged-in client that owns the specified Session ID, or nil if there's none
+local function findLoggedInClient(aSessionID)
+	for client, state in pairs(gClientStates) do
+		if (state.isLoggedIn and (state.sessionID == aSessionID)) then
+			return client, state
+		end
+	end
+	return nil
+end
+
+
+
+
+
+--- Sends a single packet with the specified raw payload over the socket, without any logging
+-- Raises an error if the client socket fails
+local function sendPacket(aClient, aMessageType, aPayload)
+	assert(type(aClient) == "userdata")
+	assert(type(aMessageType) == "number")
+	assert(type(aPayload) == "string")
+
+	local state = clientState(aClient)
+	local res, msg = aClient:send(serializeHeader(state.sessionID, state.sequenceNum, aMessageType, string.len(aPayload)) .. aPayload)
+	if not(res) then
+		error(msg)
+	end
+	state.sequenceNum = state.sequenceNum + 1
+end
+
+
+
+
+
 --- Sends the specified payload over the socket
 local function sendPayload(aClient, aMessageType, aPayload)
 	assert(type(aClient) == "userdata")
@@ -61,9 +159,7 @@ local function sendPayload(aClient, aMessageType, aPayload)
 
 	-- Send the data:
 	print("Sending payload of type " .. tostring(aMessageType) .. ".")
-	aClient:send(serializeHeader(gSessionID, gSequenceNum, aMessageType, string.len(aPayload)))
-	aClient:send(aPayload)
-	gSequenceNum = gSequenceNum + 1
+	sendPacket(aClient, aMessageType, aPayload)
 end
 
 
@@ -78,7 +174,6 @@ local function processPayloadLoginReq(aClient, aHeader, aPayload)
 	assert(type(aPayload) == "string")
 
 	print("Received a Login req")
-	gSessionID = 0x0000000d;
 
 	local j = assert(json.decode(aPayload))
 	if ((j.UserName ~= "goodUser") or (j.EncryptType ~= "MD5") or (j.PassWord ~= "HfhyFPRN")) then
@@ -89,8 +184,11 @@ local function processPayloadLoginReq(aClient, aHeader, aPayload)
 	end
 
 	print("Access allowed.")
-	gIsLoggedIn = true
-	return sendPayload(aClient, MessageType.Login_Resp, '{ "AliveInterval" : 21, "ChannelNum" : 4, "DataUseAES" : false, "DeviceType " : "HVR", "ExtraChannel" : 0, "Ret" : 100, "SessionID" : "0x0000000D" }')
+	local state = clientState(aClient)
+	state.isLoggedIn = true
+	state.sessionID = gNextSessionID
+	gNextSessionID = gNextSessionID + 1
+	return sendPayload(aClient, MessageType.Login_Resp, '{ "AliveInterval" : 21, "ChannelNum" : 4, "DataUseAES" : false, "DeviceType " : "HVR", "ExtraChannel" : 0, "Ret" : 100, "SessionID" : "' .. sessionIDString(aClient) .. '" }')
 end
 
 
@@ -103,7 +201,7 @@ local function processPayloadKeepAlive(aClient, aHeader, aPayload)
 	assert(type(aHeader) == "table")
 	assert(type(aPayload) == "string")
 
-	return sendPayload(aClient, MessageType.KeepAlive_Resp, '{ "Ret" : 100, "SessionID" : "0x0000000D" }')
+	return sendPayload(aClient, MessageType.KeepAlive_Resp, '{ "Ret" : 100, "SessionID" : "' .. sessionIDString(aClient) .. '" }')
 end
 
 
@@ -116,7 +214,7 @@ local function processPayloadConfigChannelTitleGet(aClient, aHeader, aPayload)
 	assert(type(aPayload) == "string")
 
 	-- User needs to be logged in:
-	if not(gIsLoggedIn) then
+	if not(clientState(aClient).isLoggedIn) then
 		print("Cannot send ChannelTitle response, not logged in.")
 		return sendPayload(aClient, MessageType.ConfigChannelTitleGet_Resp, {Ret = Error.UserNotLoggedIn})
 	end
@@ -155,7 +253,7 @@ local function processPayloadNetSnap(aClient, aHeader, aPayload)
 	assert(type(aPayload) == "string")
 
 	-- User needs to be logged in:
-	if not(gIsLoggedIn) then
+	if not(clientState(aClient).isLoggedIn) then
 		print("Cannot send OPSNAP response, not logged in.")
 		return sendPayload(aClient, MessageType.NetSnap_Resp, {Ret = Error.UserNotLoggedIn})
 	end
@@ -190,16 +288,15 @@ local function processPayloadGuard(aClient, aHeader, aPayload)
 	assert(type(aPayload) == "string")
 
 	-- User needs to be logged in:
-	if not(gIsLoggedIn) then
+	if not(clientState(aClient).isLoggedIn) then
 		print("Cannot send Guard response, not logged in.")
 		return sendPayload(aClient, MessageType.Guard_Resp, {Ret = Error.UserNotLoggedIn})
 	end
 
-	-- Success, start sending alarms
+	-- Success, start sending alarms (upon idle timeouts in the main loop)
 	print("Client will receive alarms")
-	gWantsAlarms = true
-	aClient:settimeout(1)  -- Timeout after 1 second when reporting alarms
-	sendPayload(aClient, MessageType.Guard_Resp, '{ "Name" : "", "Ret" : 100, "SessionID" : "0x0000000D" }')
+	gAlarmClient = aClient
+	sendPayload(aClient, MessageType.Guard_Resp, '{ "Name" : "", "Ret" : 100, "SessionID" : "' .. sessionIDString(aClient) .. '" }')
 end
 
 
@@ -225,7 +322,7 @@ local function processPayloadSysInfo(aClient, aHeader, aPayload)
 				},
 				Name = "SystemInfo",
 				Ret = Error.Success,
-				SessionID = 0x0d,
+				SessionID = clientState(aClient).sessionID,
 			}
 		)
 	end
@@ -252,7 +349,7 @@ local function processPayloadAbility(aClient, aHeader, aPayload)
 				MultiLanguage = {"English", "Czech", "Slovakia"},
 				Name = "MultiLanguage",
 				Ret = Error.Success,
-				SessionID = 0x0d,
+				SessionID = clientState(aClient).sessionID,
 			}
 		)
 	end
@@ -271,31 +368,212 @@ local function processPayloadGetConfig(aClient, aHeader, aPayload)
 	assert(type(aPayload) == "string")
 
 	local j = assert(json.decode(aPayload))
-	if (j.Name == "General.General") then
-		-- Send bogus config data:
-		print("Sending an example config General.General data.")
-		sendPayload(aClient, MessageType.ConfigGet_Resp,
-			{
-				["General.General"] =
-				{
-					LocalNo = 8,
-					AutoLogout = 0,
-					ScreenAutoShutdown = 10,
-					ScreenSaveTime = 0,
-					OverWrite = "OverWrite",
-					VideoOutPut = "AUTO",
-					MachineName = "XiongMai",
-					SnapInterval = 2,
-				},
-				Name = "General.General",
-				Ret = Error.Success,
-				SessionID = 0x0d,
-			}
-		)
+	local value = gConfigs[j.Name]
+	if not(value) then
+		-- Send an error: Unknown config name:
+		return sendPayload(aClient, MessageType.ConfigGet_Resp, {Ret = Error.IllegalRequest, Msg = "Unknown config name"})
 	end
 
-	-- Send an error: Unknown config name:
-	return sendPayload(aClient, MessageType.ConfigGet_Resp, {Ret = Error.IllegalRequest, Msg = "Unknown config name"})
+	-- Send the stored config data:
+	print("Sending the config " .. j.Name .. " data.")
+	return sendPayload(aClient, MessageType.ConfigGet_Resp,
+		{
+			[j.Name] = value,
+			Name = j.Name,
+			Ret = Error.Success,
+			SessionID = clientState(aClient).sessionID,
+		}
+	)
+end
+
+
+
+
+
+local function processPayloadSetConfig(aClient, aHeader, aPayload)
+	assert(type(aHeader) == "table")
+	assert(type(aHeader.MessageType) == "number")
+	assert(type(aPayload) == "string")
+
+	-- User needs to be logged in:
+	if not(clientState(aClient).isLoggedIn) then
+		print("Cannot set config, not logged in.")
+		return sendPayload(aClient, MessageType.ConfigSet_Resp, {Ret = Error.UserNotLoggedIn})
+	end
+
+	-- Only the existing configs can be set, and the value needs to be of the same type:
+	local j = assert(json.decode(aPayload))
+	if ((type(j.Name) ~= "string") or (gConfigs[j.Name] == nil)) then
+		print("Cannot set config, unknown config name: " .. tostring(j.Name))
+		return sendPayload(aClient, MessageType.ConfigSet_Resp, {Ret = Error.ConfigurationDoesNotExist})
+	end
+	if (type(j[j.Name]) ~= type(gConfigs[j.Name])) then
+		print("Cannot set config " .. j.Name .. ", bad value type: " .. type(j[j.Name]))
+		return sendPayload(aClient, MessageType.ConfigSet_Resp, {Ret = Error.ConfigurationParsingError})
+	end
+
+	print("Setting the config " .. j.Name .. ".")
+	gConfigs[j.Name] = j[j.Name]
+	return sendPayload(aClient, MessageType.ConfigSet_Resp, '{ "Name" : "", "Ret" : 100, "SessionID" : "' .. sessionIDString(aClient) .. '" }')
+end
+
+
+
+
+
+--- Returns the 4 bytes of the CapturedStream packed datetime for the specified time
+-- Bits, from the LSB: second (6), minute (6), hour (5), day (5), month (4), year - 2000 (6)
+local function packCapturedStreamDateTime(aTime)
+	assert(type(aTime) == "number")
+
+	local t = os.date("*t", aTime)
+	return writeUint32(
+		t.sec +
+		t.min * 64 +
+		t.hour * 4096 +
+		t.day * 131072 +
+		t.month * 4194304 +
+		(t.year - 2000) * 67108864
+	)
+end
+
+
+
+
+
+--- Returns a synthetic raw CapturedStream, used for remote playback when no playback file is given
+-- The stream is aNumSeconds long, 25 fps H.264, with an I-frame every 2 seconds; the NAL units are bogus filler
+local function generateSyntheticCapturedStream(aNumSeconds)
+	assert(type(aNumSeconds) == "number")
+
+	local fps = 25
+	local gopLength = 2 * fps
+	local startTime = os.time() - aNumSeconds
+	local iFrameNals =
+		"\0\0\0\1\103" .. string.rep("\170", 20) ..    -- SPS
+		"\0\0\0\1\104" .. string.rep("\170", 4) ..     -- PPS
+		"\0\0\0\1\101" .. string.rep("\170", 24 * 1024)  -- IDR slice
+	local pFrameNals = "\0\0\0\1\65" .. string.rep("\85", 3 * 1024)  -- Non-IDR slice
+	local frames = {}
+	for i = 0, aNumSeconds * fps - 1 do
+		if ((i % gopLength) == 0) then
+			-- I-frame: 16-byte header with the codec (2 = H.264), fps, width / 8, height / 8, datetime and length:
+			frames[#frames + 1] =
+				"\0\0\1\252\2" .. string.char(fps, 1280 / 8, 720 / 8) ..
+				packCapturedStreamDateTime(startTime + math.floor(i / fps)) ..
+				writeUint32(string.len(iFrameNals)) ..
+				iFrameNals
+		else
+			-- P-frame: 8-byte header with the length:
+			frames[#frames + 1] = "\0\0\1\253" .. writeUint32(string.len(pFrameNals)) .. pFrameNals
+		end
+	end
+	return table.concat(frames)
+end
+
+
+
+
+
+--- Sends the whole playback stream to the data connection, as fast as the socket accepts it, followed by the EOF packet
+-- aMessageType is the message type to use for the data packets (Play_Data for playback, DownloadData for download)
+local function streamPlayback(aDataClient, aMessageType)
+	assert(type(aDataClient) == "userdata")
+	assert(type(aMessageType) == "number")
+
+	local data
+	if (gPlaybackFileName) then
+		local f = assert(io.open(gPlaybackFileName, "rb"))
+		data = f:read("*a")
+		f:close()
+	else
+		data = generateSyntheticCapturedStream(60)
+	end
+
+	print("Streaming " .. string.len(data) .. " bytes of playback data as message type " .. aMessageType .. ".")
+	local startTime = socket.gettime()
+	local numPackets = 0
+	for ofs = 1, string.len(data), gPlaybackPacketSize do
+		sendPacket(aDataClient, aMessageType, string.sub(data, ofs, ofs + gPlaybackPacketSize - 1))
+		numPackets = numPackets + 1
+	end
+	sendPacket(aDataClient, MessageType.Play_Eof, "")
+	local elapsed = math.max(socket.gettime() - startTime, 0.001)
+	print(string.format("Playback streamed: %d packets in %.3f sec (%.1f MiB/s).",
+		numPackets, elapsed, string.len(data) / elapsed / 1048576
+	))
+end
+
+
+
+
+
+--- Processes the OPPlayBack Claim request, received on the data connection
+local function processPayloadPlayClaim(aClient, aHeader, aPayload)
+	assert(type(aClient) == "userdata")
+	assert(type(aHeader) == "table")
+	assert(type(aPayload) == "string")
+
+	-- The data connection doesn't log in, it needs to reuse a logged-in control connection's session:
+	local controlClient, controlState = findLoggedInClient(aHeader.SessionID)
+	if (not(controlClient) or (controlClient == aClient)) then
+		print("Cannot claim playback, no control connection logged in with session " .. tostring(aHeader.SessionID) .. ".")
+		return sendPayload(aClient, MessageType.PlayClaim_Resp, {Ret = Error.UserNotLoggedIn})
+	end
+
+	local j = assert(json.decode(aPayload))
+	if ((j.Name ~= "OPPlayBack") or (type(j.OPPlayBack) ~= "table") or (j.OPPlayBack.Action ~= "Claim")) then
+		print("Cannot claim playback, bad request.")
+		return sendPayload(aClient, MessageType.PlayClaim_Resp, {Ret = Error.IllegalRequest})
+	end
+
+	print("Playback claimed by the data connection.")
+	clientState(aClient).sessionID = controlState.sessionID
+	controlState.playbackClient = aClient
+	return sendPayload(aClient, MessageType.PlayClaim_Resp, { Name = "", Ret = Error.Success, SessionID = sessionIDString(aClient) })
+end
+
+
+
+
+
+--- Processes the OPPlayBack request (Start, DownloadStart, Stop), received on the control connection
+-- Start and DownloadStart stream the whole playback into the claimed data connection before returning.
+local function processPayloadPlay(aClient, aHeader, aPayload)
+	assert(type(aClient) == "userdata")
+	assert(type(aHeader) == "table")
+	assert(type(aPayload) == "string")
+
+	-- User needs to be logged in:
+	local state = clientState(aClient)
+	if (not(state.isLoggedIn) or (aHeader.SessionID ~= state.sessionID)) then
+		print("Cannot send OPPlayBack response, not logged in.")
+		return sendPayload(aClient, MessageType.Play_Resp, {Ret = Error.UserNotLoggedIn})
+	end
+
+	local j = assert(json.decode(aPayload))
+	if ((j.Name ~= "OPPlayBack") or (type(j.OPPlayBack) ~= "table")) then
+		print("Cannot send OPPlayBack response, bad request.")
+		return sendPayload(aClient, MessageType.Play_Resp, {Ret = Error.IllegalRequest})
+	end
+	local action = j.OPPlayBack.Action
+	local dataMessageType
+	if (action == "Start") then
+		dataMessageType = MessageType.Play_Data
+	elseif (action == "DownloadStart") then
+		dataMessageType = MessageType.DownloadData
+	else
+		-- Stop, Pause etc. are simply acknowledged:
+		print("Acknowledging OPPlayBack action " .. tostring(action) .. ".")
+		return sendPayload(aClient, MessageType.Play_Resp, { Name = "", Ret = Error.Success, SessionID = sessionIDString(aClient) })
+	end
+	if not(state.playbackClient) then
+		print("Cannot start playback, no data connection has claimed it.")
+		return sendPayload(aClient, MessageType.Play_Resp, {Ret = Error.IllegalRequest})
+	end
+
+	sendPayload(aClient, MessageType.Play_Resp, { Name = "", Ret = Error.Success, SessionID = sessionIDString(aClient) })
+	streamPlayback(state.playbackClient, dataMessageType)
 end
 
 
@@ -324,6 +602,12 @@ local function processPayload(aClient, aHeader, aPayload)
 		return processPayloadAbility(aClient, aHeader, aPayload)
 	elseif (aHeader.MessageType == MessageType.ConfigGet_Req) then
 		return processPayloadGetConfig(aClient, aHeader, aPayload)
+	elseif (aHeader.MessageType == MessageType.ConfigSet_Req) then
+		return processPayloadSetConfig(aClient, aHeader, aPayload)
+	elseif (aHeader.MessageType == MessageType.PlayClaim_Req) then
+		return processPayloadPlayClaim(aClient, aHeader, aPayload)
+	elseif (aHeader.MessageType == MessageType.Play_Req) then
+		return processPayloadPlay(aClient, aHeader, aPayload)
 	-- TODO: Other message types
 	end
 	assert(false, "Unhandled mesasge type: " .. tostring(aHeader.MessageType))
@@ -340,8 +624,8 @@ local function sendAlarm(aClient)
 
 	print("Sending an alarm.")
 	local timestamp = os.date("%Y-%m-%d %H:%M:%S")
-	sendPayload(aClient, MessageType.Alarm_Req, '{ "AlarmInfo" : { "Channel" : 0, "Event" : "VideoMotion", "StartTime" : "' .. timestamp .. '", "Status" : "Start" }, "Name" : "AlarmInfo", "SessionID" : "0xd" }')
-	sendPayload(aClient, MessageType.Alarm_Req, '{ "AlarmInfo" : { "Channel" : 0, "Event" : "VideoMotion", "StartTime" : "' .. timestamp .. '", "Status" : "Stop" }, "Name" : "AlarmInfo", "SessionID" : "0xd" }')
+	sendPayload(aClient, MessageType.Alarm_Req, '{ "AlarmInfo" : { "Channel" : 0, "Event" : "VideoMotion", "StartTime" : "' .. timestamp .. '", "Status" : "Start" }, "Name" : "AlarmInfo", "SessionID" : "' .. sessionIDString(aClient) .. '" }')
+	sendPayload(aClient, MessageType.Alarm_Req, '{ "AlarmInfo" : { "Channel" : 0, "Event" : "VideoMotion", "StartTime" : "' .. timestamp .. '", "Status" : "Stop" }, "Name" : "AlarmInfo", "SessionID" : "' .. sessionIDString(aClient) .. '" }')
 end
 
 
@@ -349,9 +633,10 @@ end
 
 
 --- Receives exactly the specified number of bytes from the client
+-- Must be called from within the client's coroutine; yields to the main loop whenever there's no more data
+-- ready to be read, the main loop resumes the coroutine once the socket becomes readable again.
 -- Returns the received bytes, as a string, on success
 -- If the requested number of bytes is zero, returns an empty string
--- If there's a timeout while receiving, either sends an alarm (if alarm monitoring has been requested) or raises an error (if not)
 -- If there's any other error while receiving, throws the error
 local function receiveBytesFromClient(aClient, aNumBytes)
 	assert(type(aClient) == "userdata")
@@ -359,21 +644,15 @@ local function receiveBytesFromClient(aClient, aNumBytes)
 
 	local received = ""
 	while (aNumBytes > 0) do
+		aClient:settimeout(0)
 		local d, msg, partial = aClient:receive(aNumBytes)
+		aClient:settimeout(nil)  -- Sending is blocking
 		if not(d) then
+			received = received .. (partial or "")
+			aNumBytes = aNumBytes - string.len(partial or "")
 			if (msg == "timeout") then
-				-- Timeout waiting for the next request, send an alarm if alarm monitoring is on:
-				if (gWantsAlarms) then
-					gNumTimeoutsBeforeAlarm = gNumTimeoutsBeforeAlarm - 1
-					if (gNumTimeoutsBeforeAlarm <= 0) then
-						sendAlarm(aClient)
-						gNumTimeoutsBeforeAlarm = math.random(1, 3)
-					end
-					received = received .. (partial or "")
-					aNumBytes = aNumBytes - string.len(partial or "")
-				else
-					error(msg)
-				end
+				-- No more data ready, wait for the main loop to tell us there's more:
+				coroutine.yield()
 			else
 				-- Another error from the socket, raise it:
 				error(msg)
@@ -406,27 +685,98 @@ end
 
 
 
+--- Called when there was no activity on any of the sockets for a second
+-- Sends an alarm to the client that asked for them, after a random number of such timeouts.
+local function onIdleTimeout()
+	if not(gAlarmClient) then
+		return
+	end
+	gNumTimeoutsBeforeAlarm = gNumTimeoutsBeforeAlarm - 1
+	if (gNumTimeoutsBeforeAlarm <= 0) then
+		pcall(sendAlarm, gAlarmClient)
+		gNumTimeoutsBeforeAlarm = math.random(1, 3)
+	end
+end
+
+
+
+
+
 -- Simulate:
 local server = assert(socket.bind("localhost", 34567, 0))
-for _, arg in ipairs(args) do
-	if (arg == "--use-timeout") then
-		server:settimeout(10)
-	end
-	if (arg == "--singleshot") then
+local serverTimeout = nil
+local i = 1
+while (args[i]) do
+	if (args[i] == "--use-timeout") then
+		serverTimeout = 10
+	elseif (args[i] == "--singleshot") then
 		gIsSingleShot = true
+	elseif (args[i] == "--playback-file") then
+		i = i + 1
+		gPlaybackFileName = assert(args[i], "The --playback-file param needs a filename")
 	end
+	i = i + 1
 end
 print("Simulator ready.\n\n")
 io.output():flush()
+
+--- The currently connected clients, as an array of {socket = <client socket>, coroutine = <its handler>}
+local clients = {}
+
+--- The client that connected first while there were no other clients; ends the simulation in singleshot mode
+local firstClient = nil
+
+local lastActivity = socket.gettime()
 while (true) do
-	local client = assert(server:accept())
-	print("Client connected: " .. tostring(client:getpeername()))
-	local res, msg = pcall(simulateClient, client)
-	if not(res) then
-		print("Client terminated: " .. tostring(msg))
+	-- Wait for any of the sockets to become readable, 1 second at most (for the alarms):
+	local sockets = {server}
+	for _, c in ipairs(clients) do
+		sockets[#sockets + 1] = c.socket
 	end
-	if (gIsSingleShot) then
-		return
+	local readable = socket.select(sockets, nil, 1)
+	if not(readable[1]) then
+		onIdleTimeout()
+		if (serverTimeout and not(clients[1]) and (socket.gettime() - lastActivity > serverTimeout)) then
+			error("No incoming connection within the timeout")
+		end
+	else
+		lastActivity = socket.gettime()
+	end
+
+	-- Accept a new client:
+	if (readable[server]) then
+		local client = assert(server:accept())
+		print("Client connected: " .. tostring(client:getpeername()))
+		if not(clients[1]) then
+			firstClient = client
+		end
+		local co = coroutine.create(simulateClient)
+		clients[#clients + 1] = {socket = client, coroutine = co}
+		readable[client] = true  -- Start the coroutine right away
+	end
+
+	-- Resume the clients that have data, drop the ones that have terminated:
+	for idx = #clients, 1, -1 do
+		local c = clients[idx]
+		if (readable[c.socket]) then
+			local res, msg = coroutine.resume(c.coroutine, c.socket)
+			if (coroutine.status(c.coroutine) == "dead") then
+				print("Client terminated: " .. tostring(msg))
+				c.socket:close()
+				table.remove(clients, idx)
+				if (gAlarmClient == c.socket) then
+					gAlarmClient = nil
+				end
+				gClientStates[c.socket] = nil
+				for _, state in pairs(gClientStates) do
+					if (state.playbackClient == c.socket) then
+						state.playbackClient = nil
+					end
+				end
+				if (gIsSingleShot and (c.socket == firstClient)) then
+					return
+				end
+			end
+		end
 	end
-	gWantsAlarms = false
 end
@@ -0,0 +1,19 @@
+-- SimulatorConfig.lua
+
+--[[
+The configuration of the SimpleSimulator, in the same format as RealDeviceConfig.
+
+Pass "SimulatorConfig" as the config module name to the real-device tests that accept one (such as R18) to run
+them against the simulator instead of a real device.
+--]]
+
+
+
+
+return
+{
+	hostName = "localhost",
+	port = 34567,
+	username = "goodUser",
+	passwordHash = "HfhyFPRN",  -- The only credentials accepted by the simulator
+}
@@ -0,0 +1,784 @@
+#define _CRT_SECURE_NO_WARNINGS 1
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <iostream>
+#include "fmt/format.h"
+#include "Recorder.hpp"
+
+
+
+
+
+using namespace NetSurveillancePp;
+
+
+
+
+
+/*
+A content-addressed snapshot store: the pictures are deduplicated by their contents, each unique picture
+is stored only once, in append-only pack files, and a per-channel time index points to the shared pictures.
+The store consists of these files, all numbers are little-endian:
+	- <prefix>.snapidx: The index, the cIndexMagic followed by the 32-byte records, one for each added snapshot:
+		timestamp in msec since the epoch (8), picture hash (8), channel (4), pack number (4), offset in the pack (4), size (4)
+	- <prefix>.NNNNNN.snappack: The pack files, each a series of pictures, each preceded by a 16-byte header:
+		cBlobMagic (4), size (4), hash (8)
+A new pack file is started once the current one would grow over cMaxPackSize.
+*/
+
+/** The magic at the start of the index file. */
+static const char cIndexMagic[8] = {'N', 'S', 'P', 'S', 'I', 'X', '0', '1'};
+
+/** The magic at the start of each picture's header in the pack files. */
+static const char cBlobMagic[4] = {'N', 'S', 'P', 'B'};
+
+/** The size of a single record in the index file. */
+static const size_t cIndexRecordSize = 32;
+
+/** The size of the header preceding each picture in the pack files. */
+static const size_t cBlobHeaderSize = 16;
+
+/** The maximum size of a single pack file. Keeps the offsets within 32 bits (and within a long for fseek). */
+static const uint32_t cMaxPackSize = 256 * 1024 * 1024;
+
+
+
+
+
+/** Reads a little-endian number of the specified size from the buffer. */
+static uint64_t readLE(const uint8_t * aData, size_t aSize)
+{
+	uint64_t res = 0;
+	for (size_t i = aSize; i > 0; --i)
+	{
+		res = (res << 8) | aData[i - 1];
+	}
+	return res;
+}
+
+
+
+
+
+/** Writes a little-endian number of the specified size into the buffer. */
+static void writeLE(uint8_t * aData, uint64_t aValue, size_t aSize)
+{
+	for (size_t i = 0; i < aSize; ++i)
+	{
+		aData[i] = static_cast<uint8_t>(aValue >> (8 * i));
+	}
+}
+
+
+
+
+
+/** Computes the 64-bit xxHash (XXH64) of the data, with a zero seed.
+A fast non-cryptographic hash; byte-identical pictures are still verified byte-by-byte before being deduplicated. */
+static uint64_t xxHash64(const void * aData, size_t aSize)
+{
+	static const uint64_t cPrime1 = 0x9E3779B185EBCA87ULL;
+	static const uint64_t cPrime2 = 0xC2B2AE3D27D4EB4FULL;
+	static const uint64_t cPrime3 = 0x165667B19E3779F9ULL;
+	static const uint64_t cPrime4 = 0x85EBCA77C2B2AE63ULL;
+	static const uint64_t cPrime5 = 0x27D4EB2F165667C5ULL;
+	auto rotl = [](uint64_t aValue, int aBits) { return (aValue << aBits) | (aValue >> (64 - aBits)); };
+	auto round = [&rotl](uint64_t aAcc, uint64_t aInput)
+	{
+		aAcc += aInput * cPrime2;
+		return rotl(aAcc, 31) * cPrime1;
+	};
+	auto mergeRound = [&round](uint64_t aAcc, uint64_t aValue)
+	{
+		aAcc ^= round(0, aValue);
+		return aAcc * cPrime1 + cPrime4;
+	};
+
+	auto p = static_cast<const uint8_t *>(aData);
+	auto end = p + aSize;
+	uint64_t h;
+	if (aSize >= 32)
+	{
+		uint64_t v1 = cPrime1 + cPrime2;
+		uint64_t v2 = cPrime2;
+		uint64_t v3 = 0;
+		uint64_t v4 = 0 - cPrime1;
+		for (; p + 32 <= end; p += 32)
+		{
+			v1 = round(v1, readLE(p, 8));
+			v2 = round(v2, readLE(p + 8, 8));
+			v3 = round(v3, readLE(p + 16, 8));
+			v4 = round(v4, readLE(p + 24, 8));
+		}
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = mergeRound(h, v1);
+		h = mergeRound(h, v2);
+		h = mergeRound(h, v3);
+		h = mergeRound(h, v4);
+	}
+	else
+	{
+		h = cPrime5;
+	}
+	h += static_cast<uint64_t>(aSize);
+	for (; p + 8 <= end; p += 8)
+	{
+		h ^= round(0, readLE(p, 8));
+		h = rotl(h, 27) * cPrime1 + cPrime4;
+	}
+	if (p + 4 <= end)
+	{
+		h ^= readLE(p, 4) * cPrime1;
+		h = rotl(h, 23) * cPrime2 + cPrime3;
+		p += 4;
+	}
+	for (; p < end; ++p)
+	{
+		h ^= (*p) * cPrime5;
+		h = rotl(h, 11) * cPrime1;
+	}
+	h ^= h >> 33;
+	h *= cPrime2;
+	h ^= h >> 29;
+	h *= cPrime3;
+	h ^= h >> 32;
+	return h;
+}
+
+
+
+
+
+/** Stores the snapshots of multiple channels, deduplicating byte-identical pictures.
+All the methods throw a std::runtime_error on I/O failure. Not thread-safe. */
+class SnapshotStore
+{
+public:
+
+	/** The location of a single stored picture. */
+	struct BlobRef
+	{
+		uint32_t mPack;
+		uint32_t mOffset;  // Of the blob header
+		uint32_t mSize;    // Of the picture data
+		uint64_t mHash;
+	};
+
+
+	/** A single snapshot in a channel's time index. */
+	struct Entry
+	{
+		int64_t mTimeStampMs;
+		BlobRef mBlob;
+	};
+
+
+	/** Opens the store with the specified files' prefix and loads the whole index into memory.
+	If aIsReadOnly is false, the store is created if it doesn't exist yet and is ready for adding snapshots.
+	If aIsReadOnly is true, the files are only opened for reading and the store must already exist. */
+	SnapshotStore(const std::string & aPrefix, bool aIsReadOnly):
+		mPrefix(aPrefix),
+		mIsReadOnly(aIsReadOnly),
+		mIndexFile(nullptr),
+		mCurrentPackFile(nullptr),
+		mCurrentPackNum(0),
+		mCurrentPackSize(0)
+	{
+		loadIndex();
+		findLastPack();
+		if (!mIsReadOnly)
+		{
+			openCurrentPack();
+		}
+	}
+
+
+	~SnapshotStore()
+	{
+		if (mIndexFile != nullptr)
+		{
+			fclose(mIndexFile);
+		}
+		if (mCurrentPackFile != nullptr)
+		{
+			fclose(mCurrentPackFile);
+		}
+	}
+
+
+	/** Adds a snapshot of the channel, taken at the specified time.
+	If an identical picture is already stored, only the index record is written.
+	Returns true if the picture was stored, false if it was deduplicated. */
+	bool add(int aChannel, int64_t aTimeStampMs, const void * aData, size_t aSize)
+	{
+		if (mIsReadOnly)
+		{
+			throw std::runtime_error("The store is opened read-only");
+		}
+		if (aSize > cMaxPackSize - cBlobHeaderSize)
+		{
+			throw std::runtime_error(fmt::format("The picture is too large: {} bytes", aSize));
+		}
+		auto hash = xxHash64(aData, aSize);
+		mNumBytesAdded += aSize;
+
+		// Look for an identical picture; the channel's previous picture is checked in memory, others are read back:
+		const BlobRef * existing = nullptr;
+		auto range = mBlobsByHash.equal_range(hash);
+		for (auto itr = range.first; itr != range.second; ++itr)
+		{
+			if ((itr->second.mSize == aSize) && isSameData(aChannel, itr->second, aData, aSize))
+			{
+				existing = &itr->second;
+				break;
+			}
+		}
+
+		BlobRef blob;
+		if (existing != nullptr)
+		{
+			blob = *existing;
+		}
+		else
+		{
+			blob = writeBlob(aData, aSize, hash);
+			mBlobsByHash.emplace(hash, blob);
+		}
+		appendIndexRecord(aChannel, {aTimeStampMs, blob});
+		auto & last = mLastPicture[aChannel];
+		last.first = blob;
+		last.second.assign(static_cast<const char *>(aData), static_cast<const char *>(aData) + aSize);
+		return (existing == nullptr);
+	}
+
+
+	/** Returns the newest snapshot of the channel taken at or before the specified time, or nullptr if there's none.
+	A binary search in the channel's time-sorted index. */
+	const Entry * find(int aChannel, int64_t aTimeStampMs) const
+	{
+		auto itr = mChannels.find(aChannel);
+		if (itr == mChannels.end())
+		{
+			return nullptr;
+		}
+		const auto & entries = itr->second;
+		auto after = std::upper_bound(entries.begin(), entries.end(), aTimeStampMs,
+			[](int64_t aTime, const Entry & aEntry)
+			{
+				return aTime < aEntry.mTimeStampMs;
+			}
+		);
+		if (after == entries.begin())
+		{
+			return nullptr;
+		}
+		return &*(after - 1);
+	}
+
+
+	/** Reads the stored picture. */
+	std::vector<char> read(const BlobRef & aBlob)
+	{
+		std::vector<char> res(aBlob.mSize);
+		auto f = openPackForReading(aBlob.mPack);
+		if (
+			(fseek(f, static_cast<long>(aBlob.mOffset + cBlobHeaderSize), SEEK_SET) != 0) ||
+			(fread(res.data(), 1, res.size(), f) != res.size())
+		)
+		{
+			throw std::runtime_error(fmt::format("Cannot read picture from pack {} at offset {}", aBlob.mPack, aBlob.mOffset));
+		}
+		return res;
+	}
+
+
+	/** Returns the total number of snapshots in the store, over all channels. */
+	size_t numSnapshots() const
+	{
+		size_t res = 0;
+		for (const auto & ch: mChannels)
+		{
+			res += ch.second.size();
+		}
+		return res;
+	}
+
+
+	/** Returns the number of unique pictures stored. */
+	size_t numUniquePictures() const
+	{
+		return mBlobsByHash.size();
+	}
+
+
+	/** Prints the store's statistics. */
+	void printStats(std::ostream & aOut) const
+	{
+		for (const auto & ch: mChannels)
+		{
+			aOut << fmt::format("  Channel {}: {} snapshots", ch.first, ch.second.size());
+			if (!ch.second.empty())
+			{
+				aOut << fmt::format(", from {} to {}",
+					Recorder::formatTimeStamp(static_cast<time_t>(ch.second.front().mTimeStampMs / 1000)),
+					Recorder::formatTimeStamp(static_cast<time_t>(ch.second.back().mTimeStampMs / 1000))
+				);
+			}
+			aOut << "\n";
+		}
+		uint64_t storedBytes = 0;
+		for (const auto & blob: mBlobsByHash)
+		{
+			storedBytes += blob.second.mSize;
+		}
+		aOut << fmt::format("  {} snapshots share {} unique pictures, {} bytes in {} pack files\n",
+			numSnapshots(), mBlobsByHash.size(), storedBytes, mCurrentPackNum + 1
+		);
+		if (mNumBytesAdded > 0)
+		{
+			aOut << fmt::format("  This session: {} picture bytes added, {} bytes written ({:.1f} %)\n",
+				mNumBytesAdded, mNumBytesWritten, 100.0 * static_cast<double>(mNumBytesWritten) / static_cast<double>(mNumBytesAdded)
+			);
+		}
+	}
+
+
+protected:
+
+	/** The prefix of all the store's files. */
+	std::string mPrefix;
+
+	/** If true, the store's files are only read, never created nor written. */
+	bool mIsReadOnly;
+
+	/** The index file, opened for appending (for reading only, if mIsReadOnly). */
+	FILE * mIndexFile;
+
+	/** The pack file into which new pictures are appended. */
+	FILE * mCurrentPackFile;
+
+	/** The number of the pack file into which new pictures are appended. */
+	uint32_t mCurrentPackNum;
+
+	/** The current size of the current pack file. */
+	uint32_t mCurrentPackSize;
+
+	/** The pack files opened for reading, by pack number. */
+	std::map<uint32_t, std::unique_ptr<FILE, int (*)(FILE *)>> mReadPacks;
+
+	/** The time index of each channel, sorted by the timestamp. */
+	std::map<int, std::vector<Entry>> mChannels;
+
+	/** All the stored pictures, by their hash. */
+	std::unordered_multimap<uint64_t, BlobRef> mBlobsByHash;
+
+	/** The last picture added to each channel in this session, with its data, for the in-memory comparison.
+	Static scenes produce the same picture as the previous one, this saves reading it back from the pack. */
+	std::map<int, std::pair<BlobRef, std::vector<char>>> mLastPicture;
+
+	/** The number of picture bytes added and the number of bytes actually written (pictures, headers and index), in this session. */
+	uint64_t mNumBytesAdded = 0;
+	uint64_t mNumBytesWritten = 0;
+
+
+	std::string packFileName(uint32_t aPackNum) const
+	{
+		return fmt::format("{}.{:06d}.snappack", mPrefix, aPackNum);
+	}
+
+
+	/** Reads the whole index file into mChannels and mBlobsByHash, creating the file if it doesn't exist (unless read-only).
+	A partially written record at the end (after a crash) is cut off. */
+	void loadIndex()
+	{
+		auto fileName = mPrefix + ".snapidx";
+		mIndexFile = fopen(fileName.c_str(), mIsReadOnly ? "rb" : "r+b");
+		if ((mIndexFile == nullptr) && mIsReadOnly)
+		{
+			throw std::runtime_error(fmt::format("There's no snapshot store {} (cannot open {})", mPrefix, fileName));
+		}
+		if (mIndexFile == nullptr)
+		{
+			mIndexFile = fopen(fileName.c_str(), "w+b");
+			if ((mIndexFile == nullptr) || (fwrite(cIndexMagic, sizeof(cIndexMagic), 1, mIndexFile) != 1) || (fflush(mIndexFile) != 0))
+			{
+				throw std::runtime_error(fmt::format("Cannot create the index file {}", fileName));
+			}
+			return;
+		}
+		char magic[sizeof(cIndexMagic)];
+		if ((fread(magic, sizeof(magic), 1, mIndexFile) != 1) || (memcmp(magic, cIndexMagic, sizeof(magic)) != 0))
+		{
+			throw std::runtime_error(fmt::format("The file {} is not a snapshot store index", fileName));
+		}
+		std::unordered_map<uint64_t, std::vector<BlobRef>> seen;
+		uint8_t rec[cIndexRecordSize];
+		long validEnd = static_cast<long>(sizeof(cIndexMagic));
+		while (fread(rec, sizeof(rec), 1, mIndexFile) == 1)
+		{
+			auto channel = static_cast<int>(static_cast<int32_t>(readLE(rec + 16, 4)));
+			Entry entry{
+				static_cast<int64_t>(readLE(rec, 8)),
+				{
+					static_cast<uint32_t>(readLE(rec + 20, 4)),
+					static_cast<uint32_t>(readLE(rec + 24, 4)),
+					static_cast<uint32_t>(readLE(rec + 28, 4)),
+					readLE(rec + 8, 8)
+				}
+			};
+			insertEntry(channel, entry);
+			mCurrentPackNum = std::max(mCurrentPackNum, entry.mBlob.mPack);
+			auto & sameHash = seen[entry.mBlob.mHash];
+			auto isKnown = std::any_of(sameHash.begin(), sameHash.end(),
+				[&entry](const BlobRef & aBlob)
+				{
+					return (aBlob.mPack == entry.mBlob.mPack) && (aBlob.mOffset == entry.mBlob.mOffset);
+				}
+			);
+			if (!isKnown)
+			{
+				sameHash.push_back(entry.mBlob);
+				mBlobsByHash.emplace(entry.mBlob.mHash, entry.mBlob);
+			}
+			validEnd += static_cast<long>(sizeof(rec));
+		}
+		if (fseek(mIndexFile, validEnd, SEEK_SET) != 0)
+		{
+			throw std::runtime_error(fmt::format("Cannot seek in the index file {}", fileName));
+		}
+	}
+
+
+	/** Advances mCurrentPackNum past the pack files newer than any index record
+	(all their pictures were deduplicated / crashed). */
+	void findLastPack()
+	{
+		while (true)
+		{
+			auto f = fopen(packFileName(mCurrentPackNum + 1).c_str(), "rb");
+			if (f == nullptr)
+			{
+				break;
+			}
+			fclose(f);
+			mCurrentPackNum += 1;
+		}
+	}
+
+
+	/** Opens the last pack file for appending, or starts a new one if it doesn't exist. */
+	void openCurrentPack()
+	{
+		auto fileName = packFileName(mCurrentPackNum);
+		mCurrentPackFile = fopen(fileName.c_str(), "ab");
+		if ((mCurrentPackFile == nullptr) || (fseek(mCurrentPackFile, 0, SEEK_END) != 0))
+		{
+			throw std::runtime_error(fmt::format("Cannot open the pack file {}", fileName));
+		}
+		mCurrentPackSize = static_cast<uint32_t>(ftell(mCurrentPackFile));
+	}
+
+
+	/** Inserts the entry into the channel's index, keeping it sorted by time (appending in the usual case). */
+	void insertEntry(int aChannel, const Entry & aEntry)
+	{
+		auto & entries = mChannels[aChannel];
+		if (entries.empty() || (entries.back().mTimeStampMs <= aEntry.mTimeStampMs))
+		{
+			entries.push_back(aEntry);
+			return;
+		}
+		auto itr = std::upper_bound(entries.begin(), entries.end(), aEntry.mTimeStampMs,
+			[](int64_t aTime, const Entry & aOther)
+			{
+				return aTime < aOther.mTimeStampMs;
+			}
+		);
+		entries.insert(itr, aEntry);
+	}
+
+
+	/** Returns true if the stored picture is byte-identical to the specified data. */
+	bool isSameData(int aChannel, const BlobRef & aBlob, const void * aData, size_t aSize)
+	{
+		auto last = mLastPicture.find(aChannel);
+		if ((last != mLastPicture.end()) && (last->second.first.mPack == aBlob.mPack) && (last->second.first.mOffset == aBlob.mOffset))
+		{
+			return (memcmp(last->second.second.data(), aData, aSize) == 0);
+		}
+		auto stored = read(aBlob);
+		return (memcmp(stored.data(), aData, aSize) == 0);
+	}
+
+
+	/** Appends the picture to the current pack file, starting a new pack if needed. Returns the new blob's location. */
+	BlobRef writeBlob(const void * aData, size_t aSize, uint64_t aHash)
+	{
+		if (mCurrentPackSize + cBlobHeaderSize + aSize > cMaxPackSize)
+		{
+			fclose(mCurrentPackFile);
+			mCurrentPackFile = nullptr;
+			mCurrentPackNum += 1;
+			openCurrentPack();
+		}
+		BlobRef res{mCurrentPackNum, mCurrentPackSize, static_cast<uint32_t>(aSize), aHash};
+		uint8_t hdr[cBlobHeaderSize];
+		memcpy(hdr, cBlobMagic, sizeof(cBlobMagic));
+		writeLE(hdr + 4, aSize, 4);
+		writeLE(hdr + 8, aHash, 8);
+		if (
+			(fwrite(hdr, sizeof(hdr), 1, mCurrentPackFile) != 1) ||
+			(fwrite(aData, 1, aSize, mCurrentPackFile) != aSize) ||
+			(fflush(mCurrentPackFile) != 0)
+		)
+		{
+			throw std::runtime_error(fmt::format("Cannot write to the pack file {}", packFileName(mCurrentPackNum)));
+		}
+		mCurrentPackSize += static_cast<uint32_t>(sizeof(hdr) + aSize);
+		mNumBytesWritten += sizeof(hdr) + aSize;
+		return res;
+	}
+
+
+	/** Writes the index record for the snapshot and adds it to the channel's in-memory index. */
+	void appendIndexRecord(int aChannel, const Entry & aEntry)
+	{
+		uint8_t rec[cIndexRecordSize];
+		writeLE(rec, static_cast<uint64_t>(aEntry.mTimeStampMs), 8);
+		writeLE(rec + 8, aEntry.mBlob.mHash, 8);
+		writeLE(rec + 16, static_cast<uint32_t>(aChannel), 4);
+		writeLE(rec + 20, aEntry.mBlob.mPack, 4);
+		writeLE(rec + 24, aEntry.mBlob.mOffset, 4);
+		writeLE(rec + 28, aEntry.mBlob.mSize, 4);
+		if ((fwrite(rec, sizeof(rec), 1, mIndexFile) != 1) || (fflush(mIndexFile) != 0))
+		{
+			throw std::runtime_error("Cannot write to the index file");
+		}
+		mNumBytesWritten += sizeof(rec);
+		insertEntry(aChannel, aEntry);
+	}
+
+
+	/** Returns the pack file opened for reading, opening it on first use. */
+	FILE * openPackForReading(uint32_t aPackNum)
+	{
+		auto itr = mReadPacks.find(aPackNum);
+		if (itr != mReadPacks.end())
+		{
+			return itr->second.get();
+		}
+		if ((aPackNum == mCurrentPackNum) && (mCurrentPackFile != nullptr))
+		{
+			// Make sure the reader sees everything written so far:
+			fflush(mCurrentPackFile);
+		}
+		auto f = fopen(packFileName(aPackNum).c_str(), "rb");
+		if (f == nullptr)
+		{
+			throw std::runtime_error(fmt::format("Cannot open the pack file {}", packFileName(aPackNum)));
+		}
+		mReadPacks.emplace(aPackNum, std::unique_ptr<FILE, int (*)(FILE *)>(f, &fclose));
+		return f;
+	}
+};
+
+
+
+
+
+/** Returns the current time, in msec since the epoch. */
+static int64_t nowMs()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+
+
+
+
+/** Logs into the device and polls snapshots of the channels into the store, aNumRounds times (forever if negative).
+Returns the process exit code. */
+static int poll(
+	SnapshotStore & aStore,
+	const char * aHostName, int aPort, const char * aUserName, const char * aPassword,
+	int aNumChannels, std::chrono::seconds aInterval, int aNumRounds
+)
+{
+	std::mutex mtx;
+	std::condition_variable cv;
+	bool isDone = false;
+	std::error_code lastError;
+	int numFailed = 0;
+
+	std::cout << "Connecting to " << aHostName << " : " << aPort << " using credentials " << aUserName << " / " << aPassword << "...\n";
+	auto rec = Recorder::create();
+	rec->connectAndLogin(aHostName, aPort, aUserName, aPassword,
+		[&](const std::error_code & aError)
+		{
+			std::unique_lock<std::mutex> lg(mtx);
+			lastError = aError;
+			isDone = true;
+			cv.notify_all();
+		}
+	);
+	{
+		std::unique_lock<std::mutex> lg(mtx);
+		cv.wait(lg, [&]() { return isDone; });
+		if (lastError)
+		{
+			std::cerr << "Error: " << lastError.message() << "\n";
+			return 1;
+		}
+	}
+
+	for (int round = 0; (aNumRounds < 0) || (round < aNumRounds); ++round)
+	{
+		auto roundStart = std::chrono::steady_clock::now();
+		for (int ch = 0; ch < aNumChannels; ++ch)
+		{
+			// Capture a single picture and wait for it; the store is used only on this thread:
+			std::vector<char> picture;
+			{
+				std::unique_lock<std::mutex> lg(mtx);
+				isDone = false;
+			}
+			rec->capturePicture(
+				[&](const std::error_code & aError, const void * aData, size_t aSize)
+				{
+					std::unique_lock<std::mutex> lg(mtx);
+					lastError = aError;
+					if (!aError)
+					{
+						picture.assign(static_cast<const char *>(aData), static_cast<const char *>(aData) + aSize);
+					}
+					isDone = true;
+					cv.notify_all();
+				},
+				ch
+			);
+			{
+				std::unique_lock<std::mutex> lg(mtx);
+				cv.wait(lg, [&]() { return isDone; });
+				if (lastError)
+				{
+					std::cerr << fmt::format("Channel {}: Error: {}\n", ch, lastError.message());
+					numFailed += 1;
+					continue;
+				}
+			}
+			auto isNew = aStore.add(ch, nowMs(), picture.data(), picture.size());
+			std::cout << fmt::format("Channel {}: {} bytes, {}\n", ch, picture.size(), isNew ? "stored" : "deduplicated");
+		}
+		if ((aNumRounds < 0) || (round + 1 < aNumRounds))
+		{
+			std::this_thread::sleep_until(roundStart + aInterval);
+		}
+	}
+	aStore.printStats(std::cout);
+	if (numFailed > 0)
+	{
+		std::cerr << fmt::format("{} snapshots failed to capture\n", numFailed);
+		return 1;
+	}
+	return 0;
+}
+
+
+
+
+
+int main(int aArgC, char * aArgV[])
+{
+	std::string mode = (aArgC < 3) ? "" : aArgV[1];
+	if ((mode != "poll") && (mode != "get") && (mode != "stats"))
+	{
+		std::cerr << "Usage:\n"
+			"  SnapshotStore poll <StorePrefix> <Host> <Port> <User> <Password> [<NumChannels> [<IntervalSec> [<NumRounds>]]]\n"
+			"  SnapshotStore get <StorePrefix> <Channel> <UnixTime> <OutFile>\n"
+			"  SnapshotStore stats <StorePrefix> [<ExpectedNumSnapshots> <ExpectedNumUniquePictures>]\n";
+		return 1;
+	}
+	try
+	{
+		SnapshotStore store(aArgV[2], (mode != "poll"));
+		if (mode == "stats")
+		{
+			store.printStats(std::cout);
+			if (aArgC >= 5)
+			{
+				// Check the counts (used by the tests):
+				auto expectedNumSnapshots = static_cast<size_t>(std::atoll(aArgV[3]));
+				auto expectedNumUnique = static_cast<size_t>(std::atoll(aArgV[4]));
+				if ((store.numSnapshots() != expectedNumSnapshots) || (store.numUniquePictures() != expectedNumUnique))
+				{
+					std::cerr << fmt::format("Expected {} snapshots of {} unique pictures, the store has {} of {}\n",
+						expectedNumSnapshots, expectedNumUnique, store.numSnapshots(), store.numUniquePictures()
+					);
+					return 5;
+				}
+			}
+			return 0;
+		}
+		if (mode == "get")
+		{
+			if (aArgC < 6)
+			{
+				std::cerr << "The get mode needs the channel, time and output file name\n";
+				return 1;
+			}
+			auto channel = std::atoi(aArgV[3]);
+			auto entry = store.find(channel, static_cast<int64_t>(std::atoll(aArgV[4])) * 1000 + 999);
+			if (entry == nullptr)
+			{
+				std::cerr << fmt::format("There's no snapshot of channel {} at or before that time\n", channel);
+				return 2;
+			}
+			auto picture = store.read(entry->mBlob);
+			FILE * f = fopen(aArgV[5], "wb");
+			if (f == nullptr)
+			{
+				std::cerr << fmt::format("Cannot open the output file {}\n", aArgV[5]);
+				return 3;
+			}
+			fwrite(picture.data(), 1, picture.size(), f);
+			fclose(f);
+			std::cout << fmt::format("Saved the snapshot taken at {} ({} bytes)\n",
+				Recorder::formatTimeStamp(static_cast<time_t>(entry->mTimeStampMs / 1000)), picture.size()
+			);
+			return 0;
+		}
+
+		// Poll mode:
+		auto hostName    = (aArgC < 4) ? "localhost" : aArgV[3];
+		auto portStr     = (aArgC < 5) ? "34567" : aArgV[4];
+		auto userName    = (aArgC < 6) ? "builtinUser" : aArgV[5];
+		auto password    = (aArgC < 7) ? "builtinPassword" : aArgV[6];
+		auto numChannels = (aArgC < 8) ? 1 : std::atoi(aArgV[7]);
+		auto interval    = std::chrono::seconds((aArgC < 9) ? 60 : std::atoi(aArgV[8]));
+		auto numRounds   = (aArgC < 10) ? -1 : std::atoi(aArgV[9]);
+		auto port = std::atoi(portStr);
+		if (port == 0)
+		{
+			std::cerr << "Cannot parse port, using default 34567 instead\n";
+			port = 34567;
+		}
+		return poll(store, hostName, port, userName, password, numChannels, interval, numRounds);
+	}
+	catch (const std::exception & exc)
+	{
+		std::cerr << "Error: " << exc.what() << "\n";
+		return 4;
+	}
+}